@@ -20,9 +20,27 @@ luaopen_report_none(lua_State *L);
 int
 luaopen_report_log(lua_State *L);
 
+int
+luaopen_report_trace(lua_State *L);
+
+int
+luaopen_report_json(lua_State *L);
+
+int
+luaopen_report_metrics(lua_State *L);
+
+int
+luaopen_report_progress(lua_State *L);
+
 int
 luaopen_hex(lua_State *L);
 
+/* Registry field of the file descriptor report libraries write their events into */
+#define HEX_REPORT_OUTPUT "hex.report.output"
+
+/* Registry field of the path of the report output, if given */
+#define HEX_REPORT_OUTPUT_PATH "hex.report.output.path"
+
 extern const char hex_runtime[];
 extern const unsigned long hex_runtime_size;
 
@@ -3,9 +3,11 @@
 #include <stdbool.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <err.h>
 
 #include "hex/lua.h"
+#include "profile.h"
 
 static const char version[] =
 	"Hex - Copyright (C) 2021, Valentin Debon\n"
@@ -16,12 +18,19 @@ struct hex_args {
 	const char *progname;
 	const char *loglevel;
 	const char *report;
+	const char *output;
+	const char *profile;
+	lua_Integer jobs;
+	char **targets;
+	int targetscount;
+	bool dependents;
+	bool keepgoing;
 	bool silent;
 };
 
 static void
 hex_usage(const struct hex_args *args, int status) {
-	fprintf(stderr, "usage: %s [-hs] [-L <loglevel>] [-H <report>] [-C <dir>] rituals...\n", args->progname);
+	fprintf(stderr, "usage: %s [-hskR] [-L <loglevel>] [-H <report>] [-O <output>] [-P <profile>] [-C <dir>] [-j <jobs>] [-t <material>]... rituals...\n", args->progname);
 	exit(status);
 }
 
@@ -32,6 +41,13 @@ hex_parse_args(int argc, char **argv) {
 		.progname = strrchr(*argv, '/'),
 		.loglevel = NULL,
 		.report = "log",
+		.output = NULL,
+		.profile = NULL,
+		.jobs = 0,
+		.targets = NULL,
+		.targetscount = 0,
+		.dependents = false,
+		.keepgoing = false,
 		.silent = false,
 	};
 	int c;
@@ -42,7 +58,7 @@ hex_parse_args(int argc, char **argv) {
 		args.progname++;
 	}
 
-	while (c = getopt(argc, argv, ":hsL:H:C:"), c != -1) {
+	while (c = getopt(argc, argv, ":hskRL:H:O:P:C:j:t:"), c != -1) {
 		switch (c) {
 		case 'h':
 			fputs(version, stdout);
@@ -50,15 +66,49 @@ hex_parse_args(int argc, char **argv) {
 		case 's':
 			args.silent = true;
 			break;
+		case 'k':
+			args.keepgoing = true;
+			break;
+		case 'R':
+			args.dependents = true;
+			break;
 		case 'L':
 			args.loglevel = optarg;
 			break;
 		case 'H':
 			args.report = optarg;
 			break;
+		case 'O':
+			args.output = optarg;
+			break;
+		case 'P':
+			args.profile = optarg;
+			break;
 		case 'C':
 			workdir = optarg;
 			break;
+		case 'j': {
+			char *end;
+			const unsigned long jobs = strtoul(optarg, &end, 10);
+
+			if (*optarg == '\0' || *end != '\0' || jobs == 0 || jobs > LUA_MAXINTEGER) {
+				fprintf(stderr, "%s: -j %s: Invalid jobs count\n", args.progname, optarg);
+				hex_usage(&args, EXIT_FAILURE);
+			}
+
+			args.jobs = jobs;
+		} break;
+		case 't':
+			/* Never more targets than arguments */
+			if (args.targets == NULL) {
+				args.targets = malloc(argc * sizeof (*args.targets));
+				if (args.targets == NULL) {
+					err(EXIT_FAILURE, "malloc");
+				}
+			}
+
+			args.targets[args.targetscount++] = optarg;
+			break;
 		case ':':
 			fprintf(stderr, "%s: -%c: Missing argument\n", args.progname, optopt);
 			hex_usage(&args, EXIT_FAILURE);
@@ -133,6 +183,10 @@ hex_lua_runtime_init(lua_State *L, const struct hex_args *args) {
 	static const luaL_Reg reportlibraries[] = {
 		{ "report-none", luaopen_report_none },
 		{ "report-log", luaopen_report_log },
+		{ "report-trace", luaopen_report_trace },
+		{ "report-json", luaopen_report_json },
+		{ "report-metrics", luaopen_report_metrics },
+		{ "report-progress", luaopen_report_progress },
 	};
 	static const luaL_Reg * const reportlibrariesend = reportlibraries + sizeof (reportlibraries) / sizeof (*reportlibraries);
 	const luaL_Reg *reportlibrary = reportlibraries;
@@ -147,6 +201,27 @@ hex_lua_runtime_init(lua_State *L, const struct hex_args *args) {
 		hex_usage(args, EXIT_FAILURE);
 	}
 
+	/* The standard output is shared with printed commands and executed programs, events would be mixed with them */
+	if (args->output == NULL && (reportlibrary->func == luaopen_report_trace
+		|| reportlibrary->func == luaopen_report_json || reportlibrary->func == luaopen_report_metrics)) {
+		fprintf(stderr, "%s: %s: Report requires an output file, see -O\n", args->progname, args->report);
+		hex_usage(args, EXIT_FAILURE);
+	}
+
+	/* Shared by forked processes, appending keeps their events whole */
+	if (args->output != NULL) {
+		const int fd = open(args->output, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+
+		if (fd < 0) {
+			err(EXIT_FAILURE, "open %s", args->output);
+		}
+
+		lua_pushinteger(L, fd);
+		lua_setfield(L, LUA_REGISTRYINDEX, HEX_REPORT_OUTPUT);
+		lua_pushstring(L, args->output);
+		lua_setfield(L, LUA_REGISTRYINDEX, HEX_REPORT_OUTPUT_PATH);
+	}
+
 	luaL_requiref(L, reportlibrary->name, reportlibrary->func, 1);
 	lua_setglobal(L, "report");
 
@@ -160,6 +235,54 @@ hex_lua_runtime_init(lua_State *L, const struct hex_args *args) {
 		lua_pop(L, 1);
 	}
 
+	/*****************************
+	 * Concurrent jobs, if given *
+	 *****************************/
+	if (args->jobs != 0) {
+		lua_getglobal(L, "hex");
+		lua_pushinteger(L, args->jobs);
+		lua_setfield(L, -2, "jobs");
+		lua_pop(L, 1);
+	}
+
+	/****************************
+	 * Target materials, if any *
+	 ****************************/
+	if (args->targets != NULL) {
+		lua_getglobal(L, "hex");
+		lua_createtable(L, args->targetscount, 0);
+		for (int i = 0; i < args->targetscount; i++) {
+			lua_pushstring(L, args->targets[i]);
+			lua_rawseti(L, -2, i + 1);
+		}
+		lua_setfield(L, -2, "targets");
+		lua_pop(L, 1);
+	}
+
+	if (args->dependents) {
+		lua_getglobal(L, "hex");
+		lua_pushboolean(L, args->dependents);
+		lua_setfield(L, -2, "dependents");
+		lua_pop(L, 1);
+	}
+
+	/************************************
+	 * Keep going after failures or not *
+	 ***********************************/
+	if (args->keepgoing) {
+		lua_getglobal(L, "hex");
+		lua_pushboolean(L, args->keepgoing);
+		lua_setfield(L, -2, "keepgoing");
+		lua_pop(L, 1);
+	}
+
+	/**********************
+	 * Profiler, if asked *
+	 **********************/
+	if (args->profile != NULL) {
+		profile_start(L, args->profile);
+	}
+
 	/****************************
 	 * Loading extended runtime *
 	 ****************************/
@@ -176,6 +299,20 @@ hex_lua_runtime_init(lua_State *L, const struct hex_args *args) {
 	}
 }
 
+static bool
+hex_error_reported(lua_State *L) {
+
+	if (!lua_istable(L, -1)) {
+		return false;
+	}
+
+	lua_getfield(L, -1, "reported");
+	const bool reported = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	return reported;
+}
+
 int
 main(int argc, char **argv) {
 	const struct hex_args args = hex_parse_args(argc, argv);
@@ -190,11 +327,16 @@ main(int argc, char **argv) {
 			const char * const filename = *argpos;
 
 			if (luaL_dofile(L, filename) != LUA_OK) {
-				/* NB: If not ok, only the error is pushed on the stack */
-				lua_getglobal(L, "report");
-				lua_getfield(L, -1, "failure");
-				lua_rotate(L, 1, -1);
-				lua_call(L, 1, 0);
+				/* NB: If not ok, only the error is pushed on the stack.
+				 * Errors flagged as reported, e.g. hex.perform's failed invocations, were already */
+				if (hex_error_reported(L)) {
+					lua_pop(L, 1);
+				} else {
+					lua_getglobal(L, "report");
+					lua_getfield(L, -1, "failure");
+					lua_rotate(L, 1, -1);
+					lua_call(L, 1, 0);
+				}
 				retval = EXIT_FAILURE;
 				break;
 			}
@@ -205,6 +347,10 @@ main(int argc, char **argv) {
 		retval = EXIT_FAILURE;
 	}
 
+	if (args.profile != NULL) {
+		profile_finish(L);
+	}
+
 	lua_close(L);
 
 	return retval;
@@ -0,0 +1,290 @@
+#include "profile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
+#include <err.h>
+
+/* Registry field of the samples table, folded stack -> microseconds */
+#define PROFILE_SAMPLES "hex.profile.samples"
+
+#define PROFILE_INSTRUCTIONS 1000
+#define PROFILE_DEPTH        128
+
+static struct {
+	lua_State *L;
+	int fd;
+	pid_t pid;
+	double last;
+	bool finished;
+} profile;
+
+static double
+profile_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Adds a frame label, without the separators of the folded stacks format */
+static void
+profile_addlabel(luaL_Buffer *b, const char *label) {
+
+	for (; *label != '\0'; label++) {
+		switch (*label) {
+		case ';':
+			luaL_addchar(b, ',');
+			break;
+		case '\n':
+			luaL_addchar(b, ' ');
+			break;
+		default:
+			luaL_addchar(b, *label);
+			break;
+		}
+	}
+}
+
+/* Adds the frame of a function. The runtime is stripped, so its functions
+ * are only known by their name and the line they are defined at */
+static void
+profile_addframe(lua_State *L, luaL_Buffer *b, lua_Debug *ar) {
+	char line[32];
+
+	lua_getinfo(L, "Sn", ar);
+
+	switch (*ar->what) {
+	case 'C':
+		profile_addlabel(b, ar->name != NULL ? ar->name : "?");
+		luaL_addstring(b, " [C]");
+		break;
+	case 'm':
+		luaL_addstring(b, "main chunk (");
+		profile_addlabel(b, ar->short_src);
+		luaL_addchar(b, ')');
+		break;
+	default:
+		snprintf(line, sizeof (line), ":%d)", ar->linedefined);
+		profile_addlabel(b, ar->name != NULL ? ar->name : "?");
+		luaL_addstring(b, " (");
+		profile_addlabel(b, strcmp(ar->short_src, "?") == 0 ? "hex_runtime" : ar->short_src);
+		luaL_addstring(b, line);
+		break;
+	}
+}
+
+/* Attributes elapsed seconds to the stack of L from level, followed by leaf if not NULL */
+static void
+profile_sample(lua_State *L, int level, const char *leaf, double elapsed) {
+	lua_Debug ar;
+	luaL_Buffer b;
+	int depth = level;
+
+	while (depth < level + PROFILE_DEPTH && lua_getstack(L, depth, &ar) != 0) {
+		depth++;
+	}
+
+	/* Outermost frames first */
+	luaL_buffinit(L, &b);
+	for (int current = depth - 1; current >= level; current--) {
+		lua_getstack(L, current, &ar);
+		profile_addframe(L, &b, &ar);
+		if (current != level) {
+			luaL_addchar(&b, ';');
+		}
+	}
+	if (leaf != NULL) {
+		if (depth != level) {
+			luaL_addchar(&b, ';');
+		}
+		luaL_addstring(&b, leaf);
+	}
+	luaL_pushresult(&b);
+
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_SAMPLES);
+	lua_pushvalue(L, -2);
+	lua_rawget(L, -2);
+	const lua_Number total = lua_tonumber(L, -1) + elapsed * 1e6;
+	lua_pop(L, 1);
+	lua_pushvalue(L, -2);
+	lua_pushnumber(L, total);
+	lua_rawset(L, -3);
+	lua_pop(L, 2);
+}
+
+/* Forked processes only write their own samples */
+static void
+profile_forked(lua_State *L) {
+
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, PROFILE_SAMPLES);
+
+	profile.pid = getpid();
+	profile.last = profile_clock();
+}
+
+static void
+profile_hook(lua_State *L, lua_Debug *ar) {
+	const double now = profile_clock();
+
+	if (getpid() != profile.pid) {
+		profile_forked(L);
+		return;
+	}
+
+	profile_sample(L, 0, NULL, now - profile.last);
+	profile.last = now;
+}
+
+static int
+profile_wait_finish(lua_State *L, int status, lua_KContext ctx) {
+	const double now = profile_clock();
+
+	/* A resumed coroutine waited for others to run, their time was already sampled */
+	if (status == LUA_OK && getpid() == profile.pid) {
+		profile_sample(L, 1, lua_tostring(L, lua_upvalueindex(2)), now - ctx / 1e6);
+	}
+	profile.last = now;
+
+	if (status != LUA_OK && status != LUA_YIELD) {
+		return lua_error(L);
+	}
+
+	return lua_gettop(L);
+}
+
+/* Wraps a waiting function of the hex library. Lua time up to the call is sampled
+ * first, then the time spent in the call is attributed to its leaf frame */
+static int
+profile_wait(lua_State *L) {
+	const double now = profile_clock();
+
+	if (getpid() != profile.pid) {
+		profile_forked(L);
+	} else {
+		profile_sample(L, 1, NULL, now - profile.last);
+	}
+
+	const lua_KContext ctx = now * 1e6;
+	const int nargs = lua_gettop(L);
+
+	lua_pushvalue(L, lua_upvalueindex(1));
+	lua_insert(L, 1);
+
+	return profile_wait_finish(L, lua_pcallk(L, nargs, LUA_MULTRET, 0, ctx, profile_wait_finish), ctx);
+}
+
+static void
+profile_write(lua_State *L) {
+	luaL_Buffer b;
+
+	if (profile.finished) {
+		return;
+	}
+	profile.finished = true;
+
+	lua_sethook(L, NULL, 0, 0);
+
+	/* A forked process which exits before sampling anything still has its parent's samples */
+	if (getpid() != profile.pid) {
+		return;
+	}
+
+	/* Lines are gathered first, as the buffer can't share the stack with the traversal */
+	lua_newtable(L);
+	const int lines = lua_gettop(L);
+	lua_getfield(L, LUA_REGISTRYINDEX, PROFILE_SAMPLES);
+	lua_pushnil(L);
+	while (lua_next(L, -2) != 0) {
+		const lua_Integer microseconds = lua_tonumber(L, -1);
+
+		if (microseconds > 0) {
+			lua_pushfstring(L, "%s %I\n", lua_tostring(L, -2), microseconds);
+			lua_rawseti(L, lines, luaL_len(L, lines) + 1);
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	const lua_Integer count = luaL_len(L, lines);
+	luaL_buffinit(L, &b);
+	for (lua_Integer i = 1; i <= count; i++) {
+		lua_rawgeti(L, lines, i);
+		luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+
+	/* Written at once, so concurrent processes don't interleave their samples */
+	size_t length;
+	const char *data = lua_tolstring(L, -1, &length);
+	while (length != 0) {
+		const ssize_t writeval = write(profile.fd, data, length);
+
+		if (writeval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		data += writeval;
+		length -= writeval;
+	}
+
+	lua_pop(L, 2);
+}
+
+static void
+profile_atexit(void) {
+	profile_write(profile.L);
+}
+
+void
+profile_start(lua_State *L, const char *path) {
+	static const char * const waits[] = {
+		"cast", "charm", "invoke", "reap", "wait", "waitany", "concurrently",
+	};
+	/* Opened once and shared by forked processes, which may have changed their root or directory by then */
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0666);
+
+	if (fd < 0) {
+		err(EXIT_FAILURE, "open %s", path);
+	}
+
+	profile.L = L;
+	profile.fd = fd;
+	profile.pid = getpid();
+	profile.finished = false;
+
+	lua_newtable(L);
+	lua_setfield(L, LUA_REGISTRYINDEX, PROFILE_SAMPLES);
+
+	lua_getglobal(L, "hex");
+	for (const char * const *wait = waits; wait != waits + sizeof (waits) / sizeof (*waits); wait++) {
+		lua_getfield(L, -1, *wait);
+		lua_pushfstring(L, "[wait] hex.%s", *wait);
+		lua_pushcclosure(L, profile_wait, 2);
+		lua_setfield(L, -2, *wait);
+	}
+	lua_pop(L, 1);
+
+	/* Exiting forked processes write their samples, hex itself does it before closing its state */
+	if (atexit(profile_atexit) != 0) {
+		errx(EXIT_FAILURE, "atexit: Unable to register profile writer");
+	}
+
+	profile.last = profile_clock();
+	lua_sethook(L, profile_hook, LUA_MASKCOUNT, PROFILE_INSTRUCTIONS);
+}
+
+void
+profile_finish(lua_State *L) {
+	profile_write(L);
+}
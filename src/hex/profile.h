@@ -0,0 +1,20 @@
+#ifndef HEX_PROFILE_H
+#define HEX_PROFILE_H
+
+#include "hex/lua.h"
+
+/* Starts sampling the Lua stacks of L every PROFILE_INSTRUCTIONS instructions, each sample
+ * weighted by the wall-clock time elapsed since the previous one. The process waiting functions
+ * of the hex library are wrapped, so their waits are attributed to a separate frame.
+ * Must be called once the hex library is opened, but before the runtime is loaded.
+ * Samples are appended into path in the folded stacks format, by each process at exit,
+ * and by hex itself on profile_finish, through a descriptor opened once and inherited by forked processes. */
+void
+profile_start(lua_State *L, const char *path);
+
+/* Stops sampling, and writes the samples of the calling process */
+void
+profile_finish(lua_State *L);
+
+/* HEX_PROFILE_H */
+#endif
@@ -0,0 +1,143 @@
+#include "digest.h"
+
+#include <string.h>
+
+#define DIGEST_C1 0x87C37B91114253D5ULL
+#define DIGEST_C2 0x4CF5AD432745937FULL
+
+static inline uint64_t
+digest_rotl(uint64_t x, int r) {
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+digest_fmix(uint64_t k) {
+	k ^= k >> 33;
+	k *= 0xFF51AFD7ED558CCDULL;
+	k ^= k >> 33;
+	k *= 0xC4CEB9FE1A85EC53ULL;
+	k ^= k >> 33;
+	return k;
+}
+
+/* Explicit little endian loads, so digests are stable across platforms */
+static inline uint64_t
+digest_load(const unsigned char *bytes, size_t count) {
+	uint64_t value = 0;
+
+	for (size_t i = 0; i < count; i++) {
+		value |= (uint64_t)bytes[i] << (i * 8);
+	}
+
+	return value;
+}
+
+static inline void
+digest_block(struct digest *digest, const unsigned char *block) {
+	uint64_t k1 = digest_load(block, 8), k2 = digest_load(block + 8, 8);
+	uint64_t h1 = digest->h1, h2 = digest->h2;
+
+	k1 *= DIGEST_C1; k1 = digest_rotl(k1, 31); k1 *= DIGEST_C2; h1 ^= k1;
+	h1 = digest_rotl(h1, 27); h1 += h2; h1 = h1 * 5 + 0x52DCE729;
+
+	k2 *= DIGEST_C2; k2 = digest_rotl(k2, 33); k2 *= DIGEST_C1; h2 ^= k2;
+	h2 = digest_rotl(h2, 31); h2 += h1; h2 = h2 * 5 + 0x38495AB5;
+
+	digest->h1 = h1;
+	digest->h2 = h2;
+}
+
+void
+digest_init(struct digest *digest) {
+	digest->h1 = 0;
+	digest->h2 = 0;
+	digest->length = 0;
+	digest->blocklen = 0;
+}
+
+void
+digest_update(struct digest *digest, const void *data, size_t size) {
+	const unsigned char *current = data;
+
+	digest->length += size;
+
+	/* Complete any pending partial block first */
+	if (digest->blocklen != 0) {
+		const size_t missing = sizeof (digest->block) - digest->blocklen;
+		const size_t n = size < missing ? size : missing;
+
+		memcpy(digest->block + digest->blocklen, current, n);
+		digest->blocklen += n;
+		current += n;
+		size -= n;
+
+		if (digest->blocklen != sizeof (digest->block)) {
+			return;
+		}
+
+		digest_block(digest, digest->block);
+		digest->blocklen = 0;
+	}
+
+	while (size >= sizeof (digest->block)) {
+		digest_block(digest, current);
+		current += sizeof (digest->block);
+		size -= sizeof (digest->block);
+	}
+
+	memcpy(digest->block, current, size);
+	digest->blocklen = size;
+}
+
+void
+digest_update_u64(struct digest *digest, uint64_t value) {
+	unsigned char bytes[8];
+
+	for (int i = 0; i < 8; i++) {
+		bytes[i] = value >> (i * 8);
+	}
+
+	digest_update(digest, bytes, sizeof (bytes));
+}
+
+void
+digest_final(struct digest *digest, unsigned char output[DIGEST_SIZE]) {
+	const size_t tail = digest->blocklen;
+	uint64_t h1 = digest->h1, h2 = digest->h2;
+
+	if (tail > 8) {
+		uint64_t k2 = digest_load(digest->block + 8, tail - 8);
+		k2 *= DIGEST_C2; k2 = digest_rotl(k2, 33); k2 *= DIGEST_C1; h2 ^= k2;
+	}
+
+	if (tail > 0) {
+		uint64_t k1 = digest_load(digest->block, tail > 8 ? 8 : tail);
+		k1 *= DIGEST_C1; k1 = digest_rotl(k1, 31); k1 *= DIGEST_C2; h1 ^= k1;
+	}
+
+	h1 ^= digest->length;
+	h2 ^= digest->length;
+	h1 += h2;
+	h2 += h1;
+	h1 = digest_fmix(h1);
+	h2 = digest_fmix(h2);
+	h1 += h2;
+	h2 += h1;
+
+	for (int i = 0; i < 8; i++) {
+		output[i] = h1 >> (i * 8);
+		output[i + 8] = h2 >> (i * 8);
+	}
+}
+
+void
+digest_string(const unsigned char input[DIGEST_SIZE], char output[DIGEST_STRING_SIZE]) {
+	static const char digits[] = "0123456789abcdef";
+
+	for (int i = 0; i < DIGEST_SIZE; i++) {
+		output[i * 2] = digits[input[i] >> 4];
+		output[i * 2 + 1] = digits[input[i] & 0xF];
+	}
+
+	output[DIGEST_SIZE * 2] = '\0';
+}
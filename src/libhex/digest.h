@@ -0,0 +1,35 @@
+#ifndef HEX_DIGEST_H
+#define HEX_DIGEST_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define DIGEST_SIZE 16
+#define DIGEST_STRING_SIZE (DIGEST_SIZE * 2 + 1)
+
+/* Streaming MurmurHash3 (x64, 128 bits), not cryptographic,
+ * but fast and good enough to detect changes in build inputs */
+struct digest {
+	uint64_t h1, h2;
+	uint64_t length;
+	unsigned char block[16];
+	size_t blocklen;
+};
+
+void
+digest_init(struct digest *digest);
+
+void
+digest_update(struct digest *digest, const void *data, size_t size);
+
+void
+digest_update_u64(struct digest *digest, uint64_t value);
+
+void
+digest_final(struct digest *digest, unsigned char output[DIGEST_SIZE]);
+
+void
+digest_string(const unsigned char input[DIGEST_SIZE], char output[DIGEST_STRING_SIZE]);
+
+/* HEX_DIGEST_H */
+#endif
@@ -1,4 +1,259 @@
 
+-- Libraries, and functions of libraries or C ones of the global table, serialized by their name,
+-- as they are hex's own and not a performance's inputs, and C functions can't be serialized otherwise
+local libraries = { 'env', 'fs', 'hex', 'log', 'report', 'string', 'table', 'utf8' }
+local librarynames
+
+local function libraryname(value)
+	if not librarynames then
+		librarynames = { [_G] = '_G' }
+
+		-- Names are sorted, so a function found under several names is always named the same way
+		local function sortedkeys(t)
+			local keys = { }
+			for key in pairs(t) do
+				if type(key) == 'string' then
+					keys[#keys + 1] = key
+				end
+			end
+			table.sort(keys)
+			return keys
+		end
+
+		for _, name in ipairs(libraries) do
+			local library = _G[name]
+			if type(library) == 'table' then
+				librarynames[library] = librarynames[library] or name
+				for _, field in ipairs(sortedkeys(library)) do
+					local member = library[field]
+					if type(member) == 'function' then
+						librarynames[member] = librarynames[member] or name..'.'..field
+					end
+				end
+			end
+		end
+
+		for _, name in ipairs(sortedkeys(_G)) do
+			local global = _G[name]
+			if type(global) == 'function' and not pcall(string.dump, global) then
+				librarynames[global] = librarynames[global] or name
+			end
+		end
+	end
+
+	return librarynames[value]
+end
+
+-- Serializes value as a Lua expression, table keys are sorted
+-- so equal tables are always serialized the same way, also used to fingerprint them.
+-- Functions are serialized with their bytecode and upvalues, so closures of a same function differ.
+-- Tables and functions referencing one of their ancestors reference it by its depth.
+local function serialize(value, ancestors)
+	local valuetype = type(value)
+
+	if valuetype == 'table' or valuetype == 'function' then
+		local name = libraryname(value)
+		if name then
+			return name
+		end
+	elseif valuetype == 'userdata' or valuetype == 'thread' then
+		error('Unable to serialize '..valuetype..' value')
+	else
+		return string.format('%q', value)
+	end
+
+	ancestors = ancestors or { depth = 0 }
+
+	local ancestor = ancestors[value]
+	if ancestor then
+		return '@'..ancestor
+	end
+
+	ancestors.depth = ancestors.depth + 1
+	ancestors[value] = ancestors.depth
+
+	local serialized
+
+	if valuetype == 'function' then
+		local ok, bytecode = pcall(string.dump, value, true)
+		if not ok then
+			error('Unable to serialize C function not found in libraries')
+		end
+		serialized = serialize({ bytecode, table.pack(hex.upvalues(value)) }, ancestors)
+	else
+		local keys = { }
+		local keyscount = 0
+		-- Keys other than strings and numbers are sorted by their serialization
+		local serializedkeys = { }
+
+		for key in pairs(value) do
+			keyscount = keyscount + 1
+			keys[keyscount] = key
+			serializedkeys[key] = serialize(key, ancestors)
+		end
+
+		table.sort(keys, function(a, b)
+			local typea, typeb = type(a), type(b)
+
+			if typea ~= typeb then
+				return typea < typeb
+			elseif typea == 'number' or typea == 'string' then
+				return a < b
+			else
+				return serializedkeys[a] < serializedkeys[b]
+			end
+		end)
+
+		local fields = { }
+
+		for i = 1, keyscount do
+			local key = keys[i]
+			fields[i] = '['..serializedkeys[key]..']='..serialize(value[key], ancestors)
+		end
+
+		serialized = '{'..table.concat(fields, ',')..'}'
+	end
+
+	ancestors[value] = nil
+	ancestors.depth = ancestors.depth - 1
+
+	return serialized
+end
+
+-- Loads a table previously saved with savestate, an empty one if none or invalid.
+local function loadstate(path)
+	if fs.isreg(path) then
+		local ok, state = pcall(hex.dofile, path)
+
+		if ok and type(state) == 'table' then
+			return state
+		end
+	end
+
+	return { }
+end
+
+local function savestate(path, state)
+	fs.write(path, 'return ', serialize(state), '\n')
+end
+
+-- Invocations' outputs capture, bytes kept at the beginning and the end,
+-- and lines of the end handed to report.failure when an invocation fails
+hex.capture = {
+	limit = 64 * 1024 * 1024;
+	tail = 64 * 1024;
+	lines = 20;
+}
+
+-- Last lines captured of an invocation's output, if any
+local function capturedtail(output)
+	local capture = hex.capture
+	local path = output and output..'.tail'
+
+	if type(capture) ~= 'table' or not capture.lines or not path then
+		return nil
+	end
+
+	-- The scribe may still be writing it, e.g. when the invocation was killed
+	if not pcall(hex.captured, output) or not fs.isreg(path) then
+		return nil
+	end
+
+	local ok, content = pcall(fs.read, path)
+	if not ok or content == '' then
+		return nil
+	end
+
+	-- Ignore the final newline, then look backward for the first line kept
+	local last = #content
+	if content:byte(last) == 10 then
+		last = last - 1
+	end
+
+	local first = 1
+	local lines = 0
+	for position = last, 1, -1 do
+		if content:byte(position) == 10 then
+			lines = lines + 1
+			if lines == capture.lines then
+				first = position + 1
+				break
+			end
+		end
+	end
+
+	return content:sub(first, last)
+end
+
+-- Seconds a timed out process group is given to terminate before it is killed
+hex.grace = 10
+
+-- Seconds hex.perform waits at most for invocations before reporting a tick
+hex.tick = 1
+
+-- Outputs of divinations already made by this process, digest -> output
+local divinations = { }
+-- Divinations made by this process, answered without executing anything or not
+local divinationstats = { hits = 0; misses = 0; }
+
+hex.omens = { 'PATH' }
+
+hex.divine = function(...)
+	local parts = { }
+	local partscount = 1
+
+	-- Arguments are unpacked as hex.charm does, their count separates them from omens
+	for i, argument in ipairs({ ... }) do
+		if type(argument) == 'table' then
+			for j, value in ipairs(argument) do
+				partscount = partscount + 1
+				parts[partscount] = value
+			end
+		else
+			partscount = partscount + 1
+			parts[partscount] = argument
+		end
+	end
+
+	parts[1] = tostring(partscount - 1)
+
+	for i, omen in ipairs(hex.omens) do
+		local value = env.get(omen)
+		partscount = partscount + 1
+		parts[partscount] = value and omen..'='..value or omen
+	end
+
+	local key = hex.digest(table.unpack(parts, 1, partscount))
+	local output = divinations[key]
+	local path = hex.divinations and fs.path(hex.divinations, key..'.lua')
+
+	if output == nil and path and fs.isreg(path) then
+		-- A divination being written concurrently is just made again
+		local ok, saved = pcall(hex.dofile, path)
+		if ok and type(saved) == 'string' then
+			output = saved
+			divinations[key] = output
+		end
+	end
+
+	report.divination(parts[2], output ~= nil)
+
+	if output ~= nil then
+		divinationstats.hits = divinationstats.hits + 1
+	else
+		divinationstats.misses = divinationstats.misses + 1
+		output = hex.charm(table.unpack(parts, 2, partscount - #hex.omens))
+		divinations[key] = output
+
+		-- Best effort, the directory may be unreachable from a hindered invocation's root
+		if path then
+			pcall(fs.replace, path, 'return ', string.format('%q', output), '\n')
+		end
+	end
+
+	return output
+end
+
 hex.crucible = function(molten)
 
 	fs.mkdirs(molten)
@@ -8,6 +263,12 @@ hex.crucible = function(molten)
 		shackle = { };
 		melted = { };
 		env = { };
+		jobs = hex.jobs or 1;
+		incremental = false;
+		ignore = { '.git' };
+		targets = hex.targets;
+		dependents = hex.dependents or false;
+		keepgoing = hex.keepgoing or false;
 	}
 end
 
@@ -26,6 +287,7 @@ hex.melt = function(crucible, source)
 		build = build;
 		source = source;
 		dependencies = { };
+		prerequisites = { };
 		override = { };
 		setup = { };
 		env = { };
@@ -36,139 +298,1290 @@ hex.melt = function(crucible, source)
 	return material
 end
 
--- The following function returns the list of a crucible's
--- melted sources in an order satisfying each of their dependencies.
--- The implementation is crude, and the complexity may not be suited for all use cases.
-local function resolvedependencies(melted)
-	-- Pre-treatment of melted structure
-	-- A Set is a table where table[n] is true when n is inside the set
-	-- Set of all nodes without incoming edges (noincomingedges)
-	local noincomingedges = { }
-	local noincomingcount = 0
-	-- node -> nodes where all nodes have node as incoming (parents of node)
-	local edgesfrom = { }
-	-- node -> nodes where node have all nodes as incoming (children of node)
-	local edgesto = { }
+-- Calls fn for each material a material depends upon, through its dependencies or prerequisites.
+local function eachdependency(material, fn)
+	for i, dependency in pairs(material.dependencies) do
+		fn(dependency)
+	end
+
+	for ritualname, prerequisites in pairs(material.prerequisites or { }) do
+		for dependency in pairs(prerequisites) do
+			fn(dependency)
+		end
+	end
+end
+
+-- Returns the set of materials to perform: the targets and their transitive dependencies,
+-- or their transitive dependents if dependents is set. All materials without targets.
+local function selectmaterials(melted, targets, dependents)
+	if not targets then
+		return melted
+	end
+
+	-- Material name -> names of the materials it leads to
+	local edges = { }
 
-	-- The complexity of the pre-treatment should be something of O(|V|+|E|)
 	for name, material in pairs(melted) do
-		local dependencies = material.dependencies
-		local count = #dependencies
-
-		-- If we are a leaf node, we are recorded,
-		-- else the children set is extended with the dependencies
-		-- and the parent set for all dependencies
-		-- is extended (and created if non existant) with the node.
-		if count == 0 then
-			noincomingedges[name] = true
-			noincomingcount = noincomingcount + 1
-		else
-			local children = { }
-			for i, node in pairs(dependencies) do
-				local parents = edgesfrom[node]
-				if not parents then
-					parents = { }
-					edgesfrom[node] = parents
+		eachdependency(material, function(dependency)
+			if not melted[dependency] then
+				error('Unknown dependency '..dependency..' for '..name)
+			end
+
+			if dependents then
+				local names = edges[dependency]
+				if not names then
+					names = { }
+					edges[dependency] = names
 				end
+				names[name] = true
+			else
+				local names = edges[name]
+				if not names then
+					names = { }
+					edges[name] = names
+				end
+				names[dependency] = true
+			end
+		end)
+	end
+
+	local selected = { }
+	local pending = { }
+	local pendingcount = 0
+
+	for i, target in ipairs(targets) do
+		if not melted[target] then
+			error('Unknown target '..target)
+		end
+
+		pendingcount = pendingcount + 1
+		pending[pendingcount] = target
+	end
+
+	while pendingcount > 0 do
+		local name = pending[pendingcount]
+		pending[pendingcount] = nil
+		pendingcount = pendingcount - 1
+
+		if not selected[name] then
+			selected[name] = melted[name]
+
+			for next in pairs(edges[name] or { }) do
+				pendingcount = pendingcount + 1
+				pending[pendingcount] = next
+			end
+		end
+	end
+
+	return selected
+end
+
+-- The following function returns the dependency graph of a crucible's selected melted sources,
+-- with a node for each ritual of each material. A ritual depends on the previous ritual of its material.
+-- The first ritual also depends on the last ritual of all the material's dependencies,
+-- unless the material's prerequisites explicit the ones of the ritual.
+-- Dependencies upon materials which weren't selected are considered already performed.
+-- Each node keeps the count of its dependencies not yet performed, and the set of its dependents.
+-- Kahn's algorithm is run on a copy of the counts, to detect cycles before anything is performed.
+local function resolvedependencies(melted, selected, ritualnames, incantationcount)
+	-- Material name -> array of its nodes, indexed as the incantation
+	local graph = { }
+	local nodes = { }
+	local count = 0
+	-- Ritual name -> index in the incantation
+	local ritualindices = { }
+
+	for j = 1, incantationcount do
+		ritualindices[ritualnames[j] or j] = j
+	end
+
+	for name, material in pairs(selected) do
+		local materialnodes = { }
+
+		for j = 1, incantationcount do
+			local node = {
+				name = name;
+				material = material;
+				ritual = j;
+				ritualname = ritualnames[j] or j;
+				pending = 0;
+				dependencies = { };
+				dependents = { };
+			}
+
+			materialnodes[j] = node
+			count = count + 1
+			nodes[count] = node
+		end
+
+		graph[name] = materialnodes
+	end
+
+	-- Duplicated edges would be counted twice
+	local function depend(node, parent)
+		if not parent.dependents[node] then
+			parent.dependents[node] = true
+			node.pending = node.pending + 1
+			node.dependencies[node.pending] = parent
+		end
+	end
+
+	-- The complexity of the pre-treatment should be something of O(|V|+|E|)
+	for name, material in pairs(selected) do
+		local materialnodes = graph[name]
+		local prerequisites = material.prerequisites or { }
+
+		for i, dependency in pairs(material.dependencies) do
+			if not melted[dependency] then
+				error('Unknown dependency '..dependency..' for '..name)
+			end
+		end
+
+		for j = 1, incantationcount do
+			local node = materialnodes[j]
+			local ritualprerequisites = prerequisites[node.ritualname]
+
+			if j > 1 then
+				depend(node, materialnodes[j - 1])
+			end
+
+			if ritualprerequisites then
+				-- Rituals absent from the incantation have nothing to wait for
+				for dependency, ritual in pairs(ritualprerequisites) do
+					if not melted[dependency] then
+						error('Unknown prerequisite '..dependency..' for '..name..' '..node.ritualname)
+					end
 
-				children[node] = true
-				parents[name] = true
+					local parents = graph[dependency]
+					local index
+					if ritual == true then
+						index = incantationcount
+					else
+						index = ritualindices[ritual]
+					end
+
+					if parents and index then
+						depend(node, parents[index])
+					end
+				end
+			elseif j == 1 then
+				for i, dependency in pairs(material.dependencies) do
+					local parents = graph[dependency]
+					if parents then
+						depend(node, parents[incantationcount])
+					end
+				end
 			end
-			edgesto[name] = children
 		end
 	end
 
 	-- Topological sorting (cf. Kahn's algorithm)
-	-- The complexity of this one should be of O(|V|+|E|),
-	-- Leaving the function with a O(|V|+|E|), so the default
-	-- complexity of the base algorithm
-	local list = { }
-	local listcount = 0
+	local sorted = { }
+	local pending = { }
+	local noincomingedges = { }
+	local noincomingcount = 0
+	local sortedcount = 0
+
+	for i = 1, count do
+		local node = nodes[i]
+		pending[node] = node.pending
+		if node.pending == 0 then
+			noincomingcount = noincomingcount + 1
+			noincomingedges[noincomingcount] = node
+		end
+	end
 
 	while noincomingcount > 0 do
-		local node = next(noincomingedges)
-		-- Removing node
-		noincomingedges[node] = nil
+		local node = noincomingedges[noincomingcount]
+		noincomingedges[noincomingcount] = nil
 		noincomingcount = noincomingcount - 1
-		-- Adding to list
-		listcount = listcount + 1
-		list[listcount] = node
-
-		-- For all nodes on which node is a dependency,
-		-- remove the dependency, then check if the parent
-		-- still has children, if not, add it to noincomingedges
-		local parents = edgesfrom[node]
-		if parents then
-			edgesfrom[node] = nil
-			for parent in pairs(parents) do
-				local children = edgesto[parent]
-				children[node] = nil
+		sortedcount = sortedcount + 1
+		sorted[sortedcount] = node
 
-				if next(children) == nil then
-					edgesto[parent] = nil
-					noincomingedges[parent] = true
-					noincomingcount = noincomingcount + 1
-				end
+		for dependent in pairs(node.dependents) do
+			local left = pending[dependent] - 1
+			pending[dependent] = left
+			if left == 0 then
+				noincomingcount = noincomingcount + 1
+				noincomingedges[noincomingcount] = dependent
 			end
 		end
 	end
 
-	if next(edgesto) ~= nil or next(edgesfrom) ~= nil then
+	if sortedcount ~= count then
 		error('Detected a cycle in dependency graph')
 	end
 
-	return list, listcount
+	return sorted, count
+end
+
+-- Fingerprints a material's source tree by content, only files modified since
+-- the previous fingerprint are read again, according to an index kept in the molten directory.
+local function fingerprintsource(crucible, name)
+	local indices = fs.path(crucible.molten, 'fingerprints')
+
+	fs.mkdirs(indices)
+
+	return fs.fingerprint(crucible.melted[name].source, {
+		index = fs.path(indices, name);
+		ignore = crucible.ignore;
+	})
+end
+
+-- Returns a function fingerprinting a material's source tree once per performance.
+-- A material's rituals may modify its source tree, so if the source tree wasn't modified
+-- since its last invocation, the source fingerprint from before its invocation is used.
+local function fingerprinter(crucible, stamps)
+	local fingerprints = { }
+
+	return function(name)
+		local fingerprint = fingerprints[name]
+
+		if not fingerprint then
+			local previous = stamps[name]
+
+			fingerprint = fingerprintsource(crucible, name)
+			if previous and previous.output == fingerprint then
+				fingerprint = previous.input
+			end
+
+			fingerprints[name] = fingerprint
+		end
+
+		return fingerprint
+	end
+end
+
+-- Digest of a material's own inputs: source tree, setup, overrides and environment.
+local function digestmaterial(material, fingerprint, crucibleenv)
+	return hex.digest(fingerprint, serialize(material.setup),
+		serialize(material.override), serialize(material.env), crucibleenv)
+end
+
+-- Stamps each node with the digest of everything its invocation depends upon:
+-- its material's source tree, setup, overrides and environment, the crucible's environment,
+-- its ritual, and the stamps of its dependencies. A node whose stamp didn't change since
+-- its last successful invocation is marked to be skipped.
+local function stampdependencies(crucible, nodes, count, incantation, stamps, fingerprinted)
+	-- Material name -> source fingerprint and digested inputs
+	local materials = { }
+	local crucibleenv = serialize(crucible.env)
+
+	for i = 1, count do
+		local node = nodes[i]
+		local name = node.name
+		local inputs = materials[name]
+		local previous = stamps[name]
+
+		if not inputs then
+			local fingerprint = fingerprinted(name)
+
+			inputs = {
+				fingerprint = fingerprint;
+				digest = digestmaterial(node.material, fingerprint, crucibleenv);
+			}
+			materials[name] = inputs
+		end
+
+		local dependencies = { }
+		for k, dependency in ipairs(node.dependencies) do
+			dependencies[k] = dependency.stamp
+		end
+		table.sort(dependencies)
+
+		node.fingerprint = inputs.fingerprint
+		node.stamp = hex.digest(inputs.digest, tostring(node.ritualname), serialize(incantation[node.ritual]), table.unpack(dependencies))
+		node.skip = previous ~= nil and previous.rituals[node.ritualname] == node.stamp
+	end
+end
+
+-- Keys materials with the digest of their own inputs, the whole incantation
+-- and the keys of all their dependencies and prerequisites, so a key only depends upon
+-- what a material's performance could have been derived from, and not on where or when
+-- it was performed. Materials depending on themselves through prerequisites have no key.
+local function keymaterials(crucible, incantation, fingerprinted)
+	local keys = { }
+	local visiting = { }
+	local crucibleenv = serialize(crucible.env)
+	local rituals = serialize(incantation)
+
+	local function key(name)
+		local value = keys[name]
+
+		if value ~= nil then
+			return value
+		elseif visiting[name] then
+			return false
+		end
+
+		local material = crucible.melted[name]
+		local names = { }
+		local dependencies = { }
+		local dependenciescount = 0
+
+		eachdependency(material, function(dependency)
+			if not crucible.melted[dependency] then
+				error('Unknown dependency '..dependency..' for '..name)
+			end
+
+			names[dependency] = true
+		end)
+
+		visiting[name] = true
+
+		for dependency in pairs(names) do
+			local dependencykey = key(dependency)
+
+			if not dependencykey then
+				value = false
+				break
+			end
+
+			dependenciescount = dependenciescount + 1
+			dependencies[dependenciescount] = dependency..'='..dependencykey
+		end
+
+		visiting[name] = nil
+
+		if value == nil then
+			table.sort(dependencies)
+			value = hex.digest(digestmaterial(material, fingerprinted(name), crucibleenv),
+				rituals, table.unpack(dependencies))
+		end
+
+		keys[name] = value
+
+		return value
+	end
+
+	return key
+end
+
+-- Removes the least recently used entries of the cache until it fits its size.
+local function evictcache(cache, index)
+	local entries = index.entries
+	local keys = { }
+	local keyscount = 0
+	local total = 0
+
+	for key, entry in pairs(entries) do
+		keyscount = keyscount + 1
+		keys[keyscount] = key
+		total = total + entry.size
+	end
+
+	if cache.size and total > cache.size then
+		table.sort(keys, function(a, b) return entries[a].used < entries[b].used end)
+
+		for i = 1, keyscount do
+			if total <= cache.size then
+				break
+			end
+
+			local key = keys[i]
+			fs.remove(fs.path(cache.path, key))
+			total = total - entries[key].size
+			entries[key] = nil
+			index.evicted[key] = true
+		end
+	end
+end
+
+-- Saves the cache's index, merged with entries stored by concurrent performances meanwhile.
+local function savecache(cache, index)
+	local indexpath = fs.path(cache.path, 'index.lua')
+	local current = loadstate(indexpath)
+
+	for key, entry in pairs(current.entries or { }) do
+		local known = index.entries[key]
+		if known == nil and not index.evicted[key] then
+			index.entries[key] = entry
+		elseif known and entry.used > known.used then
+			known.used = entry.used
+		end
+	end
+
+	if current.tick and current.tick > index.tick then
+		index.tick = current.tick
+	end
+
+	evictcache(cache, index)
+	savestate(indexpath, { tick = index.tick; entries = index.entries; })
+end
+
+-- Removes and returns the ready node with the longest path
+-- left to perform, so the critical path is started as soon as possible.
+local function pick(ready, readycount)
+	local best = 1
+
+	for i = 2, readycount do
+		if ready[i].rank > ready[best].rank then
+			best = i
+		end
+	end
+
+	local node = ready[best]
+	ready[best] = ready[readycount]
+	ready[readycount] = nil
+
+	return node
+end
+
+-- Estimates each node's duration from previous performances, and ranks it
+-- with the longest sum of durations from itself to the end of the graph.
+-- Nodes never performed are estimated with the average of known durations.
+local function rankdependencies(nodes, count, durations)
+	local known = 0
+	local total = 0
+
+	for i = 1, count do
+		local node = nodes[i]
+		local history = durations[node.name]
+		local duration = history and history[node.ritualname]
+
+		if duration then
+			known = known + 1
+			total = total + duration
+		end
+
+		node.duration = duration
+	end
+
+	local average = known > 0 and total / known or 1
+
+	-- Nodes are topologically sorted, dependents are ranked first
+	for i = count, 1, -1 do
+		local node = nodes[i]
+		local rank = 0
+
+		if node.skip or node.cached then
+			node.duration = 0
+		elseif not node.duration then
+			node.duration = average
+		end
+
+		for dependent in pairs(node.dependents) do
+			if dependent.rank > rank then
+				rank = dependent.rank
+			end
+		end
+
+		node.rank = node.duration + rank
+	end
 end
 
+-- Simulates the performance of nodes with their estimated durations, and the
+-- same scheduling as hex.perform, returning the predicted makespan.
+local function predictmakespan(nodes, count, jobs)
+	local pending = { }
+	local ready = { }
+	local readycount = 0
+	local running = { }
+	local runningcount = 0
+	local now = 0
+
+	for i = 1, count do
+		local node = nodes[i]
+		pending[node] = node.pending
+		if node.pending == 0 then
+			readycount = readycount + 1
+			ready[readycount] = node
+		end
+	end
+
+	while readycount > 0 or runningcount > 0 do
+		while readycount > 0 and runningcount < jobs do
+			local node = pick(ready, readycount)
+			readycount = readycount - 1
+			runningcount = runningcount + 1
+			running[runningcount] = { finish = now + node.duration; node = node; }
+		end
+
+		local earliest = 1
+		for i = 2, runningcount do
+			if running[i].finish < running[earliest].finish then
+				earliest = i
+			end
+		end
+
+		local terminated = running[earliest]
+		running[earliest] = running[runningcount]
+		running[runningcount] = nil
+		runningcount = runningcount - 1
+		now = terminated.finish
+
+		for dependent in pairs(terminated.node.dependents) do
+			local left = pending[dependent] - 1
+			pending[dependent] = left
+			if left == 0 then
+				readycount = readycount + 1
+				ready[readycount] = dependent
+			end
+		end
+	end
+
+	return now
+end
+
+-- Enables the accounted and limiting controllers available in the delegated cgroup for its children
+local function delegatecgroup(cgroup)
+	local controllers = fs.read(fs.path(cgroup, 'cgroup.controllers'))
+	local enabled = { }
+	local enabledcount = 0
+
+	for controller in controllers:gmatch('%S+') do
+		if controller == 'cpu' or controller == 'cpuset' or controller == 'memory' or controller == 'io' then
+			enabledcount = enabledcount + 1
+			enabled[enabledcount] = '+'..controller
+		end
+	end
+
+	if enabledcount > 0 then
+		fs.write(fs.path(cgroup, 'cgroup.subtree_control'), table.concat(enabled, ' '))
+	end
+end
+
+-- Adds the statistics of a terminated invocation's cgroup to its usage, missing ones are ignored
+local function cgroupusage(cgroup, usage)
+	local function read(name)
+		local ok, content = pcall(fs.read, fs.path(cgroup, name))
+		return ok and content or ''
+	end
+
+	local usec = read('cpu.stat'):match('usage_usec (%d+)')
+	if usec then
+		usage.cpu = tonumber(usec) / 1000000
+	end
+
+	usage.memorypeak = tonumber(read('memory.peak'):match('%d+'))
+
+	local iostat = read('io.stat')
+	if iostat ~= '' then
+		usage.readbytes = 0
+		usage.writebytes = 0
+		for bytes in iostat:gmatch('rbytes=(%d+)') do
+			usage.readbytes = usage.readbytes + tonumber(bytes)
+		end
+		for bytes in iostat:gmatch('wbytes=(%d+)') do
+			usage.writebytes = usage.writebytes + tonumber(bytes)
+		end
+	end
+end
+
+-- Errors raised for failures already reported, still converted to their message by tostring
+local reportedfailure = {
+	__tostring = function(failure)
+		return failure.message
+	end;
+}
+
 hex.perform = function(crucible, ...)
-	-- Resolve the dependency list
-	local list, listcount = resolvedependencies(crucible.melted)
 	-- Acquire incantation from arguments
 	local incantation, ritualnames = hex.incantation(...)
 	local incantationcount = #incantation
+	-- Resolve the dependency graph
+	local selected = selectmaterials(crucible.melted, crucible.targets, crucible.dependents)
+	local nodes, count = resolvedependencies(crucible.melted, selected, ritualnames, incantationcount)
+	-- Durations of previous performances, material name -> ritual name -> seconds
+	local durationspath = fs.path(crucible.molten, 'durations.lua')
+	local durations = loadstate(durationspath)
+	-- Stamps of previous invocations, if incremental
+	local stampspath = fs.path(crucible.molten, 'stamps.lua')
+	local stamps
+	-- Cache of staged materials, and its index of entries
+	local cache = crucible.cache
+	local index
+	-- Material name -> cache key to store its stage with, once performed
+	local storekeys = { }
+	local cachestats = { hits = 0; misses = 0; bytes = 0; }
 	-- Get redirected output
 	local outputs = crucible.shackle.outputs
+	-- Delegated cgroup, each invocation is accounted in its own child cgroup
+	local cgroup = crucible.shackle.cgroup
+	-- Material name -> resources used by its invocations
+	local costs = { }
+	-- Material name -> output directory, set once its first ritual is started
+	local started = { }
+	-- Maximum count of concurrent invocations
+	local jobs = crucible.jobs or 1
+	-- Rituals whose dependencies were all performed
+	local ready = { }
+	local readycount = 0
+	-- Summoned process id -> ritual node
+	local running = { }
+	local runningcount = 0
+	-- Whether no new invocation is summoned anymore
+	local halted = false
+	-- Materials with a failed invocation, and ones with rituals skipped because of a failure
+	local failed = { }
+	local poisoned = { }
+	local failedcount = 0
+	-- Whether hex's implicit jobserver token is held by no invocation
+	local implicit = true
+	-- Previous make flags, restored once the jobserver is closed
+	local makeflags = env.get('MAKEFLAGS')
+
+	if cgroup then
+		delegatecgroup(cgroup)
+	elseif crucible.shackle.resources then
+		error('Shackle resources require a delegated cgroup')
+	else
+		-- Materials' resources would be silently ignored too
+		for i = 1, count do
+			local node = nodes[i]
+			if node.material.resources then
+				error('Resources of material '..node.name..' require a delegated cgroup')
+			end
+		end
+	end
+
+	-- Namespaces and mountpoints of the shackle are prepared once, each invocation enters a copy of them
+	local sanctum = hex.sanctum(crucible.shackle)
+	-- Material name -> writable layers of its overlay root, if any
+	local overlay = crucible.shackle.filesystem and crucible.shackle.filesystem.overlay
+	local layers = { }
+
+	-- Overlays are mounted by each invocation, only namespaces keep them from piling up in hex's own
+	if overlay and not crucible.shackle.user then
+		error('Shackle overlay filesystem requires a user')
+	end
+
+	-- Rituals whose inputs didn't change are skipped
+	if crucible.incremental then
+		stamps = loadstate(stampspath)
+	end
+
+	local fingerprinted = fingerprinter(crucible, stamps or { })
 
-	for i = 1, listcount do
-		local name = list[i]
-		local output
+	if stamps then
+		stampdependencies(crucible, nodes, count, incantation, stamps, fingerprinted)
+	end
+
+	-- Staged materials whose inputs were already performed are restored from the cache
+	if cache then
+		local key = keymaterials(crucible, incantation, fingerprinted)
+		-- Material name -> array of its nodes
+		local materials = { }
+
+		fs.mkdirs(cache.path)
+		index = loadstate(fs.path(cache.path, 'index.lua'))
+		index.tick = index.tick or 0
+		index.entries = index.entries or { }
+		index.evicted = { }
+
+		for i = 1, count do
+			local node = nodes[i]
+			local materialnodes = materials[node.name]
 
-		if outputs then
-			output = fs.path(outputs, name)
-			fs.remove(output)
-			fs.mkdirs(output)
+			if not materialnodes then
+				materialnodes = { }
+				materials[node.name] = materialnodes
+			end
+
+			materialnodes[node.ritual] = node
 		end
 
-		report.incantation(name)
+		for name, materialnodes in pairs(materials) do
+			local material = crucible.melted[name]
+			local skipped = true
 
-		for j = 1, incantationcount do
-			local ritualname = ritualnames[j]
+			for j = 1, incantationcount do
+				skipped = skipped and materialnodes[j].skip
+			end
+
+			local materialkey = material.stage and not skipped and key(name)
+
+			if materialkey then
+				if index.entries[materialkey] and fs.isdir(fs.path(cache.path, materialkey)) then
+					for j = 1, incantationcount do
+						local node = materialnodes[j]
+						node.cached = materialkey
+						node.skip = false
+					end
+				else
+					storekeys[name] = materialkey
+				end
+			end
+		end
+	end
+
+	-- Critical path first, and prediction according to previous performances
+	rankdependencies(nodes, count, durations)
+	local predicted = predictmakespan(nodes, count, jobs)
+	-- Estimated invocations, for reports to tell how far along the performance is
+	local planned = { }
+
+	for i = 1, count do
+		local node = nodes[i]
+		planned[i] = { name = node.name; ritualname = node.ritualname; duration = node.duration; }
+	end
+
+	report.plan({ invocations = planned; jobs = jobs; predicted = predicted; })
+	local begin = hex.clock()
+
+	-- Invocations share their divinations for the performance, unless a directory was explicitly given
+	local divinationsowned = not hex.divinations
+	if divinationsowned then
+		hex.divinations = fs.path(crucible.molten, 'divinations')
+		fs.remove(hex.divinations)
+		fs.mkdirs(hex.divinations)
+	end
+
+	-- Divinations of the performance, the ones of hex itself and of its invocations
+	local divined = { hits = -divinationstats.hits; misses = -divinationstats.misses; }
+
+	-- Divinations of an invocation are saved next to the ones it shares
+	local function divinedpath(node)
+		return fs.path(hex.divinations, (('divined-'..node.name..'-'..node.ritualname):gsub('/', '_'))..'.lua')
+	end
+
+	local release
+
+	-- Restores a material's stage from the cache
+	local function restore(node)
+		local entry = index.entries[node.cached]
+
+		index.tick = index.tick + 1
+		entry.used = index.tick
+
+		-- Leftovers of a previous performance aren't part of the cached stage
+		fs.remove(node.material.stage)
+		fs.mkdirs(fs.dirname(node.material.stage))
+		cachestats.hits = cachestats.hits + 1
+		cachestats.bytes = cachestats.bytes + fs.copy(fs.path(cache.path, node.cached), node.material.stage)
+
+		-- The build directory doesn't match the restored stage anymore
+		if stamps then
+			stamps[node.name] = nil
+		end
+	end
+
+	-- Stores a performed material's stage in the cache
+	local function store(node)
+		local key = storekeys[node.name]
+		local stage = node.material.stage
+
+		if fs.isdir(stage) then
+			local entry = fs.path(cache.path, key)
 
-			if not ritualname then
-				ritualname = j
+			fs.remove(entry)
+			index.tick = index.tick + 1
+			index.entries[key] = { size = fs.copy(stage, entry); used = index.tick; }
+			index.evicted[key] = nil
+
+			cachestats.misses = cachestats.misses + 1
+			cachestats.bytes = cachestats.bytes + index.entries[key].size
+
+			evictcache(cache, index)
+		end
+	end
+
+	-- A ready ritual is either skipped, restored, or waits to be started
+	local function enqueue(node)
+		if node.skip then
+			report.skip(node.name, node.ritualname, 'unchanged')
+			release(node)
+		elseif node.cached then
+			if node.ritual == 1 then
+				restore(node)
 			end
+			report.skip(node.name, node.ritualname, 'cached')
+			release(node)
+		else
+			readycount = readycount + 1
+			ready[readycount] = node
+		end
+	end
 
-			report.invocation(name, ritualname)
+	-- A performed ritual decrements its dependents' pending count,
+	-- the ones left without any are ready to be performed
+	release = function(node)
+		for dependent in pairs(node.dependents) do
+			dependent.pending = dependent.pending - 1
+			if dependent.pending == 0 then
+				enqueue(dependent)
+			end
+		end
+	end
 
-			local invocation = function()
-				local material = crucible.melted[name]
-				hex.hinder(crucible.shackle)
-				env.fill(pairs(crucible.env))
-				env.fill(pairs(material.env))
-				incantation[j](name, material)
+	-- A failed ritual's transitive dependents are never performed
+	local function poison(node)
+		for dependent in pairs(node.dependents) do
+			if not dependent.poisoned then
+				dependent.poisoned = true
+				poisoned[dependent.name] = true
+				report.skip(dependent.name, dependent.ritualname, 'poisoned')
+				poison(dependent)
 			end
+		end
+	end
+
+	-- A terminated invocation gives its job token back
+	local function relinquish(node)
+		if node.token then
+			hex.release()
+		else
+			implicit = true
+		end
+	end
+
+	-- Summons the node's ritual for the node's material
+	local function summon(node)
+		local name = node.name
+		local ritualname = node.ritualname
+		local output = started[name]
 
-			if output then
-				hex.invoke(invocation, fs.path(output, ritualname))
+		-- The first started ritual of a material begins its incantation
+		if output == nil then
+			if outputs then
+				output = fs.path(outputs, name)
+				fs.remove(output)
+				fs.mkdirs(output)
 			else
-				hex.invoke(invocation)
+				output = false
+			end
+
+			started[name] = output
+			report.incantation(name)
+
+			-- Rituals of a material share its writable layers, emptied so it starts from the lower layers
+			if overlay then
+				local materiallayers = hex.overlaylayers(crucible.molten, name)
+				fs.remove(materiallayers.upper, materiallayers.work)
+				fs.mkdirs(materiallayers.upper)
+				fs.mkdirs(materiallayers.work)
+				layers[name] = materiallayers
+			end
+		end
+
+		report.invocation(name, ritualname)
+
+		if cgroup then
+			node.cgroup = fs.path(cgroup, (('hex-'..name..'-'..ritualname):gsub('/', '_')))
+			fs.mkdirs(node.cgroup)
+		end
+
+		-- Material's resources override the shackle's ones
+		local resources = crucible.shackle.resources
+		if node.material.resources then
+			local overriden = { }
+			for key, value in pairs(resources or { }) do
+				overriden[key] = value
+			end
+			for key, value in pairs(node.material.resources) do
+				overriden[key] = value
+			end
+			resources = overriden
+		end
+
+		local invocation = function()
+			local material = node.material
+			divinationstats.hits, divinationstats.misses = 0, 0
+			hex.hinder(crucible.shackle, node.cgroup, resources, sanctum, layers[name])
+			env.fill(pairs(crucible.env))
+			env.fill(pairs(material.env))
+			incantation[node.ritual](name, material)
+
+			-- Best effort, as divinations themselves
+			if hex.divinations then
+				pcall(fs.replace, divinedpath(node), 'return ', serialize(divinationstats), '\n')
 			end
 		end
+
+		-- Invalidate the stamp until the invocation succeeds
+		if stamps then
+			local stamp = stamps[name]
+
+			if not stamp then
+				stamp = { rituals = { } }
+				stamps[name] = stamp
+			end
+
+			stamp.input = node.fingerprint
+			stamp.rituals[ritualname] = nil
+		end
+
+		node.start = hex.clock()
+
+		-- A ritual's own timeout overrides the crucible's one
+		local setup = node.material.setup[ritualname]
+		local timeout = type(setup) == 'table' and setup.timeout or crucible.timeout
+		if timeout then
+			node.deadline = node.start + timeout
+		end
+
+		local pid
+		if output then
+			pid = hex.summon(invocation, fs.path(output, ritualname))
+		else
+			pid = hex.summon(invocation)
+		end
+
+		running[pid] = node
+		runningcount = runningcount + 1
+	end
+
+	-- Jobs share tokens with every make compatible child of the invocations
+	hex.jobserver(jobs)
+
+	-- On any error, invocations still running are killed and reaped before it is raised again
+	local performed, failure = pcall(function()
+		-- Enqueuing skipped or cached nodes releases their dependents, which must not be enqueued twice
+		local initial = { }
+		local initialcount = 0
+
+		for i = 1, count do
+			local node = nodes[i]
+			if node.pending == 0 then
+				initialcount = initialcount + 1
+				initial[initialcount] = node
+			end
+		end
+
+		for i = 1, initialcount do
+			enqueue(initial[i])
+		end
+
+		while readycount > 0 or runningcount > 0 do
+			-- Start as many ready rituals as the jobs and tokens allow
+			while not halted and readycount > 0 and runningcount < jobs do
+				local token
+
+				if implicit then
+					implicit = false
+					token = false
+				elseif hex.acquire() then
+					token = true
+				else
+					break
+				end
+
+				local node = pick(ready, readycount)
+				node.token = token
+				readycount = readycount - 1
+
+				summon(node)
+			end
+
+			if runningcount == 0 then
+				break
+			end
+
+			-- Wait for any invocation to terminate, the earliest deadline, or the next tick.
+			-- If rituals are waiting for a token, an available one wakes us up.
+			local now = hex.clock()
+			local timeout = hex.tick
+
+			for _, node in pairs(running) do
+				if node.deadline and (not timeout or node.deadline - now < timeout) then
+					timeout = node.deadline - now
+				end
+			end
+
+			local pid, message, usage = hex.reap(not halted and readycount > 0 and runningcount < jobs,
+				timeout and (timeout > 0 and timeout or 0))
+
+			if pid == nil then
+				error('Lost track of '..runningcount..' summoned invocation(s)')
+			end
+
+			report.tick()
+
+			local node = running[pid]
+
+			if node then
+				running[pid] = nil
+				runningcount = runningcount - 1
+				relinquish(node)
+
+				-- The cgroup may still be busy with leftover processes, it is then kept
+				if node.cgroup then
+					cgroupusage(node.cgroup, usage)
+					pcall(fs.rmdir, node.cgroup)
+				end
+
+				local cost = costs[node.name]
+				if not cost then
+					cost = { name = node.name; cpu = 0; memory = 0; }
+					costs[node.name] = cost
+				end
+
+				cost.cpu = cost.cpu + (usage.cpu or usage.user + usage.system)
+				local memory = usage.memorypeak or usage.maxrss
+				if memory > cost.memory then
+					cost.memory = memory
+				end
+
+				report.accounting(node.name, node.ritualname, usage)
+
+				-- Even if it exited successfully once terminated
+				if node.timedout then
+					message = string.format('Timed out after %.1fs', node.timedout)
+				end
+
+				report.completion(node.name, node.ritualname, message)
+
+				if message then
+					local reason = 'Invocation of '..node.name..' '..node.ritualname..' failed: '..message
+
+					if not failed[node.name] then
+						failed[node.name] = true
+						failedcount = failedcount + 1
+					end
+
+					-- Failures are reported as they happen, with the end of their output
+					local output = started[node.name]
+					report.failure(reason, capturedtail(output and fs.path(output, node.ritualname)))
+
+					if crucible.keepgoing then
+						poison(node)
+					else
+						halted = true
+					end
+				else
+					-- Smoothed with previous performances, to absorb occasional variations
+					local elapsed = hex.clock() - node.start
+					local history = durations[node.name]
+
+					if not history then
+						history = { }
+						durations[node.name] = history
+					end
+
+					local previous = history[node.ritualname]
+					if previous then
+						elapsed = (previous + elapsed) / 2
+					end
+
+					history[node.ritualname] = elapsed
+
+					-- Only successful invocations saved their divinations
+					if hex.divinations then
+						local stats = loadstate(divinedpath(node))
+						divined.hits = divined.hits + (tonumber(stats.hits) or 0)
+						divined.misses = divined.misses + (tonumber(stats.misses) or 0)
+					end
+
+					if stamps then
+						local stamp = stamps[node.name]
+
+						stamp.rituals[node.ritualname] = node.stamp
+
+						-- Rituals may modify the source tree, it is compared to the next performance's one
+						if node.ritual == incantationcount then
+							stamp.output = fingerprintsource(crucible, node.name)
+						end
+					end
+
+					if node.ritual == incantationcount and storekeys[node.name] then
+						store(node)
+					end
+
+					if not halted then
+						release(node)
+					end
+				end
+			end
+
+			-- Timed out invocations are terminated, then killed if they outlive their grace period
+			now = hex.clock()
+			for runningpid, node in pairs(running) do
+				if node.deadline and node.deadline <= now then
+					if node.timedout then
+						hex.terminate(runningpid, true)
+						-- Killing its cgroup also reaches the process groups the invocation created
+						if node.cgroup then
+							pcall(fs.write, fs.path(node.cgroup, 'cgroup.kill'), '1')
+						end
+						node.deadline = nil
+					else
+						hex.terminate(runningpid)
+						node.timedout = now - node.start
+						node.deadline = now + hex.grace
+					end
+				end
+			end
+		end
+	end)
+
+	hex.jobserver()
+	env.set('MAKEFLAGS', makeflags)
+
+	if not performed then
+		for pid in pairs(running) do
+			pcall(hex.terminate, pid, true)
+		end
+
+		while runningcount > 0 do
+			local reaped, pid = pcall(hex.reap)
+
+			if not reaped or pid == nil then
+				break
+			end
+
+			local node = running[pid]
+			if node then
+				running[pid] = nil
+				runningcount = runningcount - 1
+				if node.cgroup then
+					pcall(fs.rmdir, node.cgroup)
+				end
+			end
+		end
+
+		if divinationsowned then
+			pcall(fs.remove, hex.divinations)
+			hex.divinations = nil
+		end
+
+		error(failure, 0)
+	end
+
+	if divinationsowned then
+		fs.remove(hex.divinations)
+		hex.divinations = nil
+	end
+
+	divined.hits = divined.hits + divinationstats.hits
+	divined.misses = divined.misses + divinationstats.misses
+
+	savestate(durationspath, durations)
+
+	if stamps then
+		savestate(stampspath, stamps)
+	end
+
+	if cache then
+		savecache(cache, index)
+	end
+
+	-- Sorted so summaries are stable
+	local function sortednames(set, excluded)
+		local names = { }
+		local namescount = 0
+
+		for name in pairs(set) do
+			if not excluded[name] then
+				namescount = namescount + 1
+				names[namescount] = name
+			end
+		end
+
+		table.sort(names)
+
+		return names
+	end
+
+	-- Costliest materials first
+	local ranked = { }
+	local rankedcount = 0
+
+	for _, cost in pairs(costs) do
+		rankedcount = rankedcount + 1
+		ranked[rankedcount] = cost
+	end
+
+	table.sort(ranked, function(a, b)
+		if a.cpu ~= b.cpu then
+			return a.cpu > b.cpu
+		else
+			return a.name < b.name
+		end
+	end)
+
+	report.summary({
+		elapsed = hex.clock() - begin;
+		predicted = predicted;
+		cache = cache and cachestats;
+		divinations = divined;
+		failed = sortednames(failed, { });
+		skipped = sortednames(poisoned, failed);
+		costs = ranked;
+	})
+
+	-- Failures were already reported in details, hex doesn't report this error again
+	if failedcount > 0 then
+		error(setmetatable({
+			message = 'Performance failed for '..table.concat(sortednames(failed, { }), ', ');
+			reported = true;
+		}, reportedfailure))
+	end
+end
+
+local function hasflag(flags, flag)
+	if flags then
+		for i = 1, #flags do
+			if flags[i] == flag then
+				return true
+			end
+		end
+	end
+	return false
+end
+
+-- Flags of fs.mount which detached trees can express, the others (e.g. remount or move) require fs.mount
+local treeflags = {
+	bind = true; rec = true; silent = true;
+	rdonly = true; nosuid = true; nodev = true; noexec = true;
+	nodiratime = true; relatime = true; noatime = true; strictatime = true;
+	private = true; slave = true; shared = true; unbindable = true;
+}
+
+-- Mounts source on target, through a detached tree if supported, so its attributes
+-- are applied to the whole tree at once, before it is attached
+local function mount(source, target, fstype, flags, options)
+	local tree
+
+	if flags then
+		for i = 1, #flags do
+			if not treeflags[flags[i]] then
+				return fs.mount(source, target, fstype, flags, options)
+			end
+		end
+	end
+
+	if hasflag(flags, 'bind') then
+		tree = fs.opentree(source, hasflag(flags, 'rec'))
+	elseif fstype ~= '' then
+		tree = fs.fsmount(fstype, source, options)
+	end
+
+	if tree then
+		if flags then
+			fs.mountattr(tree, flags)
+		end
+		fs.movemount(tree, target)
+	else
+		fs.mount(source, target, fstype, flags, options)
 	end
 end
 
-hex.hinderfilesystem = function(filesystem)
-	local mountpoints = filesystem.mountpoints
+-- Mounts the filesystem's overlay at its root, with the given writable layers
+local function mountoverlay(filesystem, layers)
+	local overlay = filesystem.overlay
+	local lower = overlay.lower
+	local options
+
+	if not layers then
+		error('Overlay filesystem requires writable layers')
+	end
+
+	if type(lower) == 'table' then
+		lower = table.concat(lower, ':')
+	end
+
+	options = 'lowerdir='..lower..',upperdir='..layers.upper..',workdir='..layers.work
+	if overlay.options then
+		options = options..','..overlay.options
+	end
+
+	fs.mkdirs(filesystem.root)
+	mount('overlay', filesystem.root, 'overlay', overlay.flags, options)
+end
+
+-- Mounts the filesystem's mountpoints, without entering its root
+local function mountfilesystem(filesystem)
+	local mountpoints = filesystem.mountpoints or { }
 	local mountpointscount = #mountpoints
 	local root = filesystem.root
 
@@ -178,21 +1591,78 @@ hex.hinderfilesystem = function(filesystem)
 		local target = mountpoint.target or fs.path(root, source)
 
 		fs.mkdirs(target)
-		fs.mount(source, target, mountpoint.fstype or '', mountpoint.flags)
+		mount(source, target, mountpoint.fstype or '', mountpoint.flags)
+	end
+end
+
+hex.hinderfilesystem = function(filesystem, layers)
+	if filesystem.overlay then
+		mountoverlay(filesystem, layers)
+	end
+
+	mountfilesystem(filesystem)
+	fs.pivotroot(filesystem.root)
+end
+
+hex.overlaylayers = function(molten, name)
+	local layers = fs.path(molten, 'overlays', (name:gsub('/', '_')))
+
+	return {
+		upper = fs.path(layers, 'upper');
+		work = fs.path(layers, 'work');
+	}
+end
+
+hex.hindercgroup = function(cgroup, resources)
+	if resources then
+		for key, value in pairs(resources) do
+			fs.write(fs.path(cgroup, key), tostring(value))
+		end
 	end
 
-	fs.chroot(root)
+	fs.write(fs.path(cgroup, 'cgroup.procs'), '0')
 end
 
-hex.hinder = function(shackle)
+hex.sanctum = function(shackle)
 	local user = shackle.user
+	local filesystem = shackle.filesystem
+
 	if user then
-		hex.hinderuser(user)
+		return hex.consecrate(function()
+			hex.hinderuser(user)
+			-- Mountpoints over an overlay are mounted by each invocation, above its own overlay
+			if filesystem and not filesystem.overlay then
+				mountfilesystem(filesystem)
+			end
+		end)
+	end
+end
+
+hex.hinder = function(shackle, cgroup, resources, sanctum, layers)
+	if cgroup then
+		hex.hindercgroup(cgroup, resources or shackle.resources)
 	end
 
 	local filesystem = shackle.filesystem
+
+	-- The sanctum already holds the user namespace and the mountpoints
+	if sanctum then
+		hex.enter(sanctum)
+		if filesystem and filesystem.overlay then
+			hex.hinderfilesystem(filesystem, layers)
+		elseif filesystem then
+			fs.pivotroot(filesystem.root)
+		end
+		return
+	end
+
+	local user = shackle.user
+	if user then
+		hex.hinderuser(user)
+	end
+
 	if filesystem then
-		hex.hinderfilesystem(filesystem)
+		hex.hinderfilesystem(filesystem, layers)
 	end
 end
 
@@ -1,8 +1,15 @@
+#define _GNU_SOURCE
 #include "hex/lua.h"
+#include "digest.h"
 
 #include <stdbool.h>
+#include <stdlib.h>
+#include <limits.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <fnmatch.h>
 #include <dirent.h>
 #include <fts.h>
 #include <sys/stat.h>
@@ -17,9 +24,68 @@
 
 #ifdef __linux__
 #include <sys/ioctl.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
+#include <sched.h>
+#include <stdint.h>
 #endif
 
+#if defined(__linux__) && defined(SYS_open_tree) && defined(SYS_move_mount) \
+	&& defined(SYS_fsopen) && defined(SYS_fsconfig) && defined(SYS_fsmount) && defined(SYS_mount_setattr)
+/* Mount API of Linux 5.12, through syscall(2) as older libcs don't wrap it.
+ * Constants are those of <linux/mount.h>, which can't be included alongside <sys/mount.h> */
+#define FS_MOUNT_API
+
+#ifndef OPEN_TREE_CLONE
+#define OPEN_TREE_CLONE 1
+#endif
+#ifndef OPEN_TREE_CLOEXEC
+#define OPEN_TREE_CLOEXEC O_CLOEXEC
+#endif
+#ifndef AT_RECURSIVE
+#define AT_RECURSIVE 0x8000
+#endif
+#ifndef MOVE_MOUNT_F_EMPTY_PATH
+#define MOVE_MOUNT_F_EMPTY_PATH 0x00000004
+#endif
+#ifndef FSOPEN_CLOEXEC
+#define FSOPEN_CLOEXEC 0x00000001
+#endif
+#ifndef FSMOUNT_CLOEXEC
+#define FSMOUNT_CLOEXEC 0x00000001
+#endif
+#ifndef FSCONFIG_SET_FLAG
+#define FSCONFIG_SET_FLAG 0
+#define FSCONFIG_SET_STRING 1
+#define FSCONFIG_CMD_CREATE 6
+#endif
+#ifndef MOUNT_ATTR_RDONLY
+#define MOUNT_ATTR_RDONLY 0x00000001
+#define MOUNT_ATTR_NOSUID 0x00000002
+#define MOUNT_ATTR_NODEV 0x00000004
+#define MOUNT_ATTR_NOEXEC 0x00000008
+#define MOUNT_ATTR__ATIME 0x00000070
+#define MOUNT_ATTR_RELATIME 0x00000000
+#define MOUNT_ATTR_NOATIME 0x00000010
+#define MOUNT_ATTR_STRICTATIME 0x00000020
+#define MOUNT_ATTR_NODIRATIME 0x00000080
+#endif
+
+struct fs_mount_attr {
+	uint64_t attr_set;
+	uint64_t attr_clr;
+	uint64_t propagation;
+	uint64_t userns_fd;
+};
+#endif
+
+#define FS_TREE_METATABLE "fs.tree"
+
+/* Detached mount tree, attached with fs.movemount */
+struct fs_tree {
+	int fd;
+};
+
 struct fs_copy {
 	struct stat *srcst;
 	const char *src, *dest;
@@ -72,11 +138,11 @@ fs_copy_synopsis(lua_State *L, struct fs_copy *root) {
 	return 0;
 }
 
-static int
+static off_t
 fs_copy_file(lua_State *L, const struct fs_copy *copy) {
 #ifdef __APPLE__
 	if (clonefile(copy->src, copy->dest, 0) == 0) {
-		return 0;
+		return copy->srcst->st_size;
 	}
 #endif
 	int srcfd = open(copy->src, O_RDONLY);
@@ -97,7 +163,7 @@ fs_copy_file(lua_State *L, const struct fs_copy *copy) {
 	if (ioctl(destfd, FICLONE, srcfd) == 0) {
 		close(srcfd);
 		close(destfd);
-		return 0;
+		return copy->srcst->st_size;
 	}
 #endif
 
@@ -127,14 +193,14 @@ fs_copy_file(lua_State *L, const struct fs_copy *copy) {
 	close(srcfd);
 	close(destfd);
 
-	return 0;
+	return copy->srcst->st_size;
 }
 
-static int
+static off_t
 fs_copy_symlink(lua_State *L, const struct fs_copy *copy) {
 #ifdef __APPLE__
 	if (clonefile(copy->src, copy->dest, CLONE_NOFOLLOW) == 0) {
-		return 0;
+		return copy->srcst->st_size;
 	}
 #endif
 	char target[copy->srcst->st_size + 1];
@@ -154,7 +220,7 @@ fs_copy_symlink(lua_State *L, const struct fs_copy *copy) {
 		return luaL_error(L, "fs.copy: symlink %s %s: %s", target, copy->dest, strerror(errno));
 	}
 
-	return 0;
+	return linklen;
 }
 
 static int
@@ -172,12 +238,13 @@ fs_copy_destcpy(char *buffer, size_t buffersize, const char *relpath, const char
 	return strncpy(stpncpy(buffer, dest, destlen), relpath, buffersize - destlen) - destlen;
 }
 
-static int
+static off_t
 fs_copy_tree(lua_State *L, const struct fs_copy *root) {
 	char buffer[root->srclen + 1];
 	char * const paths[] = { strncpy(buffer, root->src, sizeof (buffer)), NULL };
 	FTS *ftsp = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, NULL);
 	FTSENT *entry = fts_read(ftsp);
+	off_t copied = 0;
 
 	/* Skipped first entry, src pre-order */
 	if (entry == NULL) {
@@ -205,11 +272,11 @@ fs_copy_tree(lua_State *L, const struct fs_copy *root) {
 		case FTS_DP:
 			break;
 		case FTS_F:
-			fs_copy_file(L, &copy);
+			copied += fs_copy_file(L, &copy);
 			break;
 		case FTS_SL:
 		case FTS_SLNONE:
-			fs_copy_symlink(L, &copy);
+			copied += fs_copy_symlink(L, &copy);
 			break;
 		case FTS_DNR:
 		case FTS_ERR:
@@ -227,37 +294,163 @@ fs_copy_tree(lua_State *L, const struct fs_copy *root) {
 
 	fts_close(ftsp);
 
-	return 0;
+	return copied;
 }
 
 static int
 lua_fs_copy(lua_State *L) {
 	struct stat st;
 	struct fs_copy root;
+	off_t copied;
 
 	root.srcst = &st;
 	root.src = luaL_checklstring(L, 1, &root.srclen),
 	root.dest = luaL_checklstring(L, 2, &root.destlen),
 
-	lua_getglobal(L, "report");
-	lua_getfield(L, -1, "copy");
-	lua_pushvalue(L, 1);
-	lua_pushvalue(L, 2);
-	lua_call(L, 2, 0);
-	lua_settop(L, 2);
-
 	fs_copy_synopsis(L, &root);
 
 	switch (st.st_mode & S_IFMT) {
 	case S_IFREG:
-		return fs_copy_file(L, &root);
+		copied = fs_copy_file(L, &root);
+		break;
 	case S_IFLNK:
-		return fs_copy_symlink(L, &root);
+		copied = fs_copy_symlink(L, &root);
+		break;
 	case S_IFDIR:
-		return fs_copy_tree(L, &root);
+		copied = fs_copy_tree(L, &root);
+		break;
 	default:
 		return luaL_error(L, "fs.copy: Unsupported copy for file %s to %s", root.src, root.dest);
 	}
+
+	/* Reported once done, only successful copies are, with their actual size */
+	lua_settop(L, 2);
+	lua_getglobal(L, "report");
+	lua_getfield(L, -1, "copy");
+	lua_pushvalue(L, 1);
+	lua_pushvalue(L, 2);
+	lua_pushinteger(L, copied);
+	lua_call(L, 3, 0);
+
+	lua_pushinteger(L, copied);
+
+	return 1;
+}
+
+static int
+lua_fs_read(lua_State *L) {
+	const char * const path = luaL_checkstring(L, 1);
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+	if (fd < 0) {
+		return luaL_error(L, "fs.read: open %s: %s", path, strerror(errno));
+	}
+
+	luaL_Buffer b;
+	char *buffer;
+	ssize_t readval;
+
+	luaL_buffinit(L, &b);
+	while (buffer = luaL_prepbuffer(&b), readval = read(fd, buffer, LUAL_BUFFERSIZE), readval > 0) {
+		luaL_addsize(&b, readval);
+	}
+
+	const int errcode = errno;
+
+	close(fd);
+
+	if (readval < 0) {
+		return luaL_error(L, "fs.read: read %s: %s", path, strerror(errcode));
+	}
+
+	luaL_pushresult(&b);
+
+	return 1;
+}
+
+static int
+lua_fs_write(lua_State *L) {
+	const char * const path = luaL_checkstring(L, 1);
+	const int top = lua_gettop(L);
+
+	for (int i = 2; i <= top; i++) {
+		luaL_checkstring(L, i);
+	}
+
+	FILE * const output = fopen(path, "w");
+	if (output == NULL) {
+		return luaL_error(L, "fs.write: fopen %s: %s", path, strerror(errno));
+	}
+
+	for (int i = 2; i <= top; i++) {
+		size_t length;
+		const char * const string = lua_tolstring(L, i, &length);
+
+		if (fwrite(string, sizeof (*string), length, output) != length) {
+			const int errcode = errno;
+			fclose(output);
+			return luaL_error(L, "fs.write: fwrite %s: %s", path, strerror(errcode));
+		}
+	}
+
+	if (fclose(output) != 0) {
+		return luaL_error(L, "fs.write: fclose %s: %s", path, strerror(errno));
+	}
+
+	return 0;
+}
+
+static int
+lua_fs_replace(lua_State *L) {
+	size_t pathlen;
+	const char * const path = luaL_checklstring(L, 1, &pathlen);
+	const int top = lua_gettop(L);
+	char temporary[pathlen + sizeof (".XXXXXX")];
+
+	for (int i = 2; i <= top; i++) {
+		luaL_checkstring(L, i);
+	}
+
+	/* Unique temporary, so concurrent writers never write into the same file */
+	memcpy(stpcpy(temporary, path), ".XXXXXX", sizeof (".XXXXXX"));
+	const int fd = mkostemp(temporary, O_CLOEXEC);
+	if (fd < 0) {
+		return luaL_error(L, "fs.replace: mkostemp %s: %s", temporary, strerror(errno));
+	}
+
+	FILE * const output = fdopen(fd, "w");
+	if (output == NULL) {
+		const int errcode = errno;
+		close(fd);
+		unlink(temporary);
+		return luaL_error(L, "fs.replace: fdopen %s: %s", temporary, strerror(errcode));
+	}
+
+	for (int i = 2; i <= top; i++) {
+		size_t length;
+		const char * const string = lua_tolstring(L, i, &length);
+
+		if (fwrite(string, sizeof (*string), length, output) != length) {
+			const int errcode = errno;
+			fclose(output);
+			unlink(temporary);
+			return luaL_error(L, "fs.replace: fwrite %s: %s", temporary, strerror(errcode));
+		}
+	}
+
+	if (fclose(output) != 0) {
+		const int errcode = errno;
+		unlink(temporary);
+		return luaL_error(L, "fs.replace: fclose %s: %s", temporary, strerror(errcode));
+	}
+
+	if (rename(temporary, path) != 0) {
+		const int errcode = errno;
+		unlink(temporary);
+		return luaL_error(L, "fs.replace: rename %s: %s", path, strerror(errcode));
+	}
+
+	return 0;
 }
 
 static int
@@ -301,6 +494,10 @@ lua_fs_remove(lua_State *L) {
 				}
 				break;
 			case FTS_DNR:
+				/* Unreadable directories, e.g. overlay filesystems' work ones, can still be removed if empty */
+				if (rmdir(entry->fts_path) == 0) {
+					break;
+				}
 			case FTS_ERR:
 			case FTS_NS:
 				if (errno == ENOENT) {
@@ -322,6 +519,503 @@ lua_fs_remove(lua_State *L) {
 	return 0;
 }
 
+/* Content digests of regular files are computed by this many threads at most */
+#define FS_FINGERPRINT_THREADS_MAX 64
+
+#define FS_FINGERPRINT_INDEX_MAGIC "hex-fingerprint-index-1\n"
+
+struct fs_fingerprint_entry {
+	char *path;
+	const char *relpath;
+	mode_t mode;
+	uint64_t ino, size, mtime, mtimensec, ctime, ctimensec;
+	int errcode;
+	unsigned char digest[DIGEST_SIZE];
+};
+
+struct fs_fingerprint {
+	size_t rootlen;
+	struct fs_fingerprint_entry *entries;
+	size_t count, capacity;
+	/* Entries whose content must be digested, consumed by workers */
+	struct fs_fingerprint_entry **pending;
+	size_t pendingcount, next;
+	pthread_mutex_t mutex;
+	/* Previous index, entries are sorted by relative path */
+	char *index;
+	struct fs_fingerprint_entry *indexed;
+	size_t indexedcount;
+	uint64_t indextime;
+};
+
+static int
+fs_fingerprint_compare(const FTSENT **a, const FTSENT **b) {
+	return strcmp((*a)->fts_name, (*b)->fts_name);
+}
+
+static int
+fs_fingerprint_compare_entries(const void *a, const void *b) {
+	return strcmp(((const struct fs_fingerprint_entry *)a)->relpath, ((const struct fs_fingerprint_entry *)b)->relpath);
+}
+
+static int
+fs_fingerprint_compare_pointers(const void *a, const void *b) {
+	return fs_fingerprint_compare_entries(*(const struct fs_fingerprint_entry * const *)a, *(const struct fs_fingerprint_entry * const *)b);
+}
+
+static void
+fs_fingerprint_free(struct fs_fingerprint *fingerprint) {
+
+	for (size_t i = 0; i < fingerprint->count; i++) {
+		free(fingerprint->entries[i].path);
+	}
+
+	free(fingerprint->entries);
+	free(fingerprint->pending);
+	free(fingerprint->indexed);
+	free(fingerprint->index);
+}
+
+static bool
+fs_fingerprint_ignored(const char *name, const char * const *ignore, size_t ignorecount) {
+
+	for (size_t i = 0; i < ignorecount; i++) {
+		if (fnmatch(ignore[i], name, 0) == 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+static inline uint64_t
+fs_fingerprint_load(const char *bytes) {
+	uint64_t value;
+	memcpy(&value, bytes, sizeof (value));
+	return value;
+}
+
+/* Loads a previously saved index, any invalid index is silently ignored.
+ * Records are native endian, indices are local to a machine:
+ * inode, size, mtime (sec, nsec), ctime (sec, nsec), path length, digest, path (NUL terminated) */
+static void
+fs_fingerprint_load_index(struct fs_fingerprint *fingerprint, const char *path) {
+	const size_t magiclen = sizeof (FS_FINGERPRINT_INDEX_MAGIC) - 1;
+	const size_t headerlen = 7 * sizeof (uint64_t) + DIGEST_SIZE;
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	struct stat st;
+
+	if (fd < 0) {
+		return;
+	}
+
+	if (fstat(fd, &st) != 0 || st.st_size < (off_t)(magiclen + sizeof (uint64_t))
+		|| (fingerprint->index = malloc(st.st_size), fingerprint->index == NULL)
+		|| read(fd, fingerprint->index, st.st_size) != st.st_size
+		|| memcmp(fingerprint->index, FS_FINGERPRINT_INDEX_MAGIC, magiclen) != 0) {
+		close(fd);
+		return;
+	}
+
+	close(fd);
+
+	const char *current = fingerprint->index + magiclen, * const end = fingerprint->index + st.st_size;
+	size_t count = 0;
+
+	fingerprint->indextime = fs_fingerprint_load(current);
+	current += sizeof (uint64_t);
+
+	/* First pass validates records and counts them */
+	for (const char *record = current; record != end; count++) {
+		uint64_t pathlen;
+
+		if ((size_t)(end - record) < headerlen
+			|| (pathlen = fs_fingerprint_load(record + 6 * sizeof (uint64_t)), (size_t)(end - record) - headerlen < pathlen)
+			|| pathlen == 0 || record[headerlen + pathlen - 1] != '\0') {
+			return;
+		}
+
+		record += headerlen + pathlen;
+	}
+
+	if (count == 0 || (fingerprint->indexed = calloc(count, sizeof (*fingerprint->indexed)), fingerprint->indexed == NULL)) {
+		return;
+	}
+
+	for (size_t i = 0; i < count; i++) {
+		struct fs_fingerprint_entry * const entry = fingerprint->indexed + i;
+
+		entry->ino = fs_fingerprint_load(current);
+		entry->size = fs_fingerprint_load(current + 1 * sizeof (uint64_t));
+		entry->mtime = fs_fingerprint_load(current + 2 * sizeof (uint64_t));
+		entry->mtimensec = fs_fingerprint_load(current + 3 * sizeof (uint64_t));
+		entry->ctime = fs_fingerprint_load(current + 4 * sizeof (uint64_t));
+		entry->ctimensec = fs_fingerprint_load(current + 5 * sizeof (uint64_t));
+		memcpy(entry->digest, current + 7 * sizeof (uint64_t), DIGEST_SIZE);
+		entry->relpath = current + headerlen;
+
+		current += headerlen + fs_fingerprint_load(current + 6 * sizeof (uint64_t));
+	}
+
+	fingerprint->indexedcount = count;
+}
+
+/* Saves the index of regular files atomically, failures only cost a slower next fingerprint */
+static void
+fs_fingerprint_save_index(struct fs_fingerprint *fingerprint, const char *path, uint64_t now) {
+	const size_t pathlen = strlen(path);
+	char temporary[pathlen + sizeof (".tmp")];
+	struct fs_fingerprint_entry **files = fingerprint->pending;
+	size_t filescount = 0;
+
+	for (size_t i = 0; i < fingerprint->count; i++) {
+		struct fs_fingerprint_entry * const entry = fingerprint->entries + i;
+
+		if (S_ISREG(entry->mode)) {
+			files[filescount++] = entry;
+		}
+	}
+
+	qsort(files, filescount, sizeof (*files), fs_fingerprint_compare_pointers);
+
+	memcpy(stpcpy(temporary, path), ".tmp", sizeof (".tmp"));
+	FILE * const output = fopen(temporary, "w");
+	if (output == NULL) {
+		return;
+	}
+
+	fwrite(FS_FINGERPRINT_INDEX_MAGIC, 1, sizeof (FS_FINGERPRINT_INDEX_MAGIC) - 1, output);
+	fwrite(&now, sizeof (now), 1, output);
+
+	for (size_t i = 0; i < filescount; i++) {
+		const struct fs_fingerprint_entry * const entry = files[i];
+		const uint64_t record[] = {
+			entry->ino, entry->size, entry->mtime, entry->mtimensec,
+			entry->ctime, entry->ctimensec, strlen(entry->relpath) + 1,
+		};
+
+		fwrite(record, sizeof (record), 1, output);
+		fwrite(entry->digest, DIGEST_SIZE, 1, output);
+		fwrite(entry->relpath, record[6], 1, output);
+	}
+
+	if (fclose(output) != 0 || rename(temporary, path) != 0) {
+		unlink(temporary);
+	}
+}
+
+/* Whether the indexed content digest of a file can be trusted. A file modified
+ * during the same second the index was written may be modified again unnoticed. */
+static bool
+fs_fingerprint_lookup(struct fs_fingerprint *fingerprint, struct fs_fingerprint_entry *entry) {
+	const struct fs_fingerprint_entry * const indexed = bsearch(entry, fingerprint->indexed,
+		fingerprint->indexedcount, sizeof (*entry), fs_fingerprint_compare_entries);
+
+	if (indexed == NULL || indexed->ino != entry->ino || indexed->size != entry->size
+		|| indexed->mtime != entry->mtime || indexed->mtimensec != entry->mtimensec
+		|| indexed->ctime != entry->ctime || indexed->ctimensec != entry->ctimensec
+		|| entry->mtime >= fingerprint->indextime || entry->ctime >= fingerprint->indextime) {
+		return false;
+	}
+
+	memcpy(entry->digest, indexed->digest, DIGEST_SIZE);
+
+	return true;
+}
+
+static int
+fs_fingerprint_content(const char *path, unsigned char output[DIGEST_SIZE]) {
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	char block[65536];
+	struct digest digest;
+	ssize_t readval;
+
+	if (fd < 0) {
+		return errno;
+	}
+
+	digest_init(&digest);
+
+	while (readval = read(fd, block, sizeof (block)), readval > 0) {
+		digest_update(&digest, block, readval);
+	}
+
+	const int errcode = readval < 0 ? errno : 0;
+	close(fd);
+
+	digest_final(&digest, output);
+
+	return errcode;
+}
+
+static void *
+fs_fingerprint_worker(void *data) {
+	struct fs_fingerprint * const fingerprint = data;
+
+	while (true) {
+		struct fs_fingerprint_entry *entry = NULL;
+
+		pthread_mutex_lock(&fingerprint->mutex);
+		if (fingerprint->next < fingerprint->pendingcount) {
+			entry = fingerprint->pending[fingerprint->next++];
+		}
+		pthread_mutex_unlock(&fingerprint->mutex);
+
+		if (entry == NULL) {
+			break;
+		}
+
+		entry->errcode = fs_fingerprint_content(entry->path, entry->digest);
+	}
+
+	return NULL;
+}
+
+/* Digests pending entries' content with a pool of threads, the calling one included */
+static void
+fs_fingerprint_digest_pending(struct fs_fingerprint *fingerprint, lua_Integer threads) {
+	pthread_t workers[FS_FINGERPRINT_THREADS_MAX];
+	size_t workerscount = 0;
+
+	if (threads <= 0) {
+		const long online = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = online > 0 ? online : 1;
+	}
+
+	if ((size_t)threads > fingerprint->pendingcount) {
+		threads = fingerprint->pendingcount;
+	}
+
+	if (threads > FS_FINGERPRINT_THREADS_MAX) {
+		threads = FS_FINGERPRINT_THREADS_MAX;
+	}
+
+	while ((lua_Integer)workerscount + 1 < threads
+		&& pthread_create(workers + workerscount, NULL, fs_fingerprint_worker, fingerprint) == 0) {
+		workerscount++;
+	}
+
+	fs_fingerprint_worker(fingerprint);
+
+	for (size_t i = 0; i < workerscount; i++) {
+		pthread_join(workers[i], NULL);
+	}
+}
+
+static int
+fs_fingerprint_append(struct fs_fingerprint *fingerprint, const FTSENT *ftsentry) {
+
+	if (fingerprint->count == fingerprint->capacity) {
+		const size_t capacity = fingerprint->capacity == 0 ? 256 : fingerprint->capacity * 2;
+		struct fs_fingerprint_entry * const entries = realloc(fingerprint->entries, capacity * sizeof (*entries));
+
+		if (entries == NULL) {
+			return errno;
+		}
+
+		fingerprint->entries = entries;
+		fingerprint->capacity = capacity;
+	}
+
+	struct fs_fingerprint_entry * const entry = fingerprint->entries + fingerprint->count;
+	const struct stat * const st = ftsentry->fts_statp;
+
+	entry->path = strdup(ftsentry->fts_path);
+	if (entry->path == NULL) {
+		return errno;
+	}
+
+	entry->relpath = entry->path + fingerprint->rootlen;
+	entry->mode = st->st_mode;
+	entry->ino = st->st_ino;
+	entry->size = st->st_size;
+	entry->mtime = st->st_mtime;
+	entry->ctime = st->st_ctime;
+#ifdef __APPLE__
+	entry->mtimensec = st->st_mtimespec.tv_nsec;
+	entry->ctimensec = st->st_ctimespec.tv_nsec;
+#else
+	entry->mtimensec = st->st_mtim.tv_nsec;
+	entry->ctimensec = st->st_ctim.tv_nsec;
+#endif
+	entry->errcode = 0;
+	memset(entry->digest, 0, DIGEST_SIZE);
+
+	fingerprint->count++;
+
+	return 0;
+}
+
+static int
+lua_fs_fingerprint(lua_State *L) {
+	size_t rootlen;
+	const char * const root = luaL_checklstring(L, 1, &rootlen);
+	const char *indexpath = NULL;
+	lua_Integer threads = 0;
+	size_t ignorecount = 0;
+
+	if (!lua_isnoneornil(L, 2)) {
+		luaL_checktype(L, 2, LUA_TTABLE);
+
+		lua_getfield(L, 2, "index");
+		indexpath = luaL_optstring(L, -1, NULL);
+
+		lua_getfield(L, 2, "threads");
+		threads = luaL_optinteger(L, -1, 0);
+
+		lua_getfield(L, 2, "ignore");
+		if (!lua_isnil(L, -1)) {
+			luaL_checktype(L, -1, LUA_TTABLE);
+			ignorecount = luaL_len(L, -1);
+		}
+	}
+
+	/* Patterns are kept alive by the options table on the stack */
+	const char *ignore[ignorecount + 1];
+	for (size_t i = 0; i < ignorecount; i++) {
+		lua_geti(L, -1, i + 1);
+		ignore[i] = luaL_checkstring(L, -1);
+		lua_pop(L, 1);
+	}
+
+	char buffer[rootlen + 1];
+	char * const paths[] = { strncpy(buffer, root, sizeof (buffer)), NULL };
+	struct fs_fingerprint fingerprint = { .rootlen = rootlen, .mutex = PTHREAD_MUTEX_INITIALIZER };
+	unsigned char output[DIGEST_SIZE];
+	char string[DIGEST_STRING_SIZE];
+	struct digest digest;
+	FTSENT *entry;
+	int errcode = 0;
+
+	/* Entries are sorted by name, so the traversal order is stable */
+	FTS * const ftsp = fts_open(paths, FTS_PHYSICAL | FTS_NOCHDIR, fs_fingerprint_compare);
+	if (ftsp == NULL) {
+		return luaL_error(L, "fs.fingerprint: fts_open %s: %s", root, strerror(errno));
+	}
+
+	while (errno = 0, entry = fts_read(ftsp), entry != NULL) {
+
+		if (entry->fts_level > FTS_ROOTLEVEL && fs_fingerprint_ignored(entry->fts_name, ignore, ignorecount)) {
+			if (entry->fts_info == FTS_D) {
+				fts_set(ftsp, entry, FTS_SKIP);
+			}
+			continue;
+		}
+
+		switch (entry->fts_info) {
+		case FTS_DP:
+			continue;
+		case FTS_D:
+		case FTS_F:
+		case FTS_SL:
+		case FTS_SLNONE:
+		case FTS_DEFAULT:
+			errcode = fs_fingerprint_append(&fingerprint, entry);
+			break;
+		default:
+			errcode = entry->fts_errno;
+			break;
+		}
+
+		if (errcode != 0) {
+			break;
+		}
+	}
+
+	if (errcode == 0 && errno != 0) {
+		errcode = errno;
+	}
+
+	/* Entries are freed by fts_close, the message is built beforehand */
+	if (errcode != 0) {
+		lua_pushfstring(L, "fs.fingerprint: fts_read %s: %s", entry != NULL ? entry->fts_path : root, strerror(errcode));
+		fts_close(ftsp);
+		fs_fingerprint_free(&fingerprint);
+		return lua_error(L);
+	}
+
+	fts_close(ftsp);
+
+	/* Without an index, only metadata is digested, modifications are detected through modification times.
+	 * With an index, contents are digested, and only the ones of files modified since the index was saved */
+	if (indexpath != NULL) {
+		const uint64_t now = time(NULL);
+
+		fingerprint.pending = malloc((fingerprint.count + 1) * sizeof (*fingerprint.pending));
+		if (fingerprint.pending == NULL) {
+			fs_fingerprint_free(&fingerprint);
+			return luaL_error(L, "fs.fingerprint: malloc: %s", strerror(errno));
+		}
+
+		fs_fingerprint_load_index(&fingerprint, indexpath);
+
+		for (size_t i = 0; i < fingerprint.count; i++) {
+			struct fs_fingerprint_entry * const current = fingerprint.entries + i;
+
+			if (S_ISREG(current->mode) && !fs_fingerprint_lookup(&fingerprint, current)) {
+				fingerprint.pending[fingerprint.pendingcount++] = current;
+			}
+		}
+
+		fs_fingerprint_digest_pending(&fingerprint, threads);
+
+		for (size_t i = 0; i < fingerprint.pendingcount; i++) {
+			if (fingerprint.pending[i]->errcode != 0) {
+				const struct fs_fingerprint_entry * const failed = fingerprint.pending[i];
+				lua_pushfstring(L, "fs.fingerprint: %s: %s", failed->path, strerror(failed->errcode));
+				fs_fingerprint_free(&fingerprint);
+				return lua_error(L);
+			}
+		}
+
+		fs_fingerprint_save_index(&fingerprint, indexpath, now);
+	}
+
+	digest_init(&digest);
+
+	for (size_t i = 0; i < fingerprint.count; i++) {
+		const struct fs_fingerprint_entry * const current = fingerprint.entries + i;
+
+		digest_update(&digest, current->relpath, strlen(current->relpath) + 1);
+
+		if (indexpath != NULL) {
+			/* Only the type and executability matter, permissions depend on umasks */
+			digest_update_u64(&digest, current->mode & (S_IFMT | S_IXUSR));
+
+			if (S_ISREG(current->mode)) {
+				digest_update(&digest, current->digest, DIGEST_SIZE);
+			} else if (S_ISLNK(current->mode)) {
+				char target[PATH_MAX];
+				const ssize_t linklen = readlink(current->path, target, sizeof (target));
+
+				if (linklen < 0) {
+					lua_pushfstring(L, "fs.fingerprint: readlink %s: %s", current->path, strerror(errno));
+					fs_fingerprint_free(&fingerprint);
+					return lua_error(L);
+				}
+
+				digest_update(&digest, target, linklen);
+			}
+		} else {
+			digest_update_u64(&digest, current->mode);
+
+			if (!S_ISDIR(current->mode)) {
+				digest_update_u64(&digest, current->size);
+				digest_update_u64(&digest, current->mtime);
+				digest_update_u64(&digest, current->mtimensec);
+			}
+		}
+	}
+
+	fs_fingerprint_free(&fingerprint);
+
+	digest_final(&digest, output);
+	digest_string(output, string);
+	lua_pushstring(L, string);
+
+	return 1;
+}
+
 static bool
 fs_parent_separator(const char *path, char **separatorp) {
 	char *separator = strchr(path, '/');
@@ -340,6 +1034,17 @@ fs_parent_separator(const char *path, char **separatorp) {
 	}
 }
 
+static int
+lua_fs_rmdir(lua_State *L) {
+	const char * const path = luaL_checkstring(L, 1);
+
+	if (rmdir(path) != 0) {
+		return luaL_error(L, "fs.rmdir: rmdir %s: %s", path, strerror(errno));
+	}
+
+	return 0;
+}
+
 static int
 lua_fs_mkdirs(lua_State *L) {
 	const int top = lua_gettop(L);
@@ -514,6 +1219,249 @@ lua_fs_umount(lua_State *L) {
 	return 0;
 }
 
+static int
+fs_tree_gc(lua_State *L) {
+	struct fs_tree * const tree = luaL_checkudata(L, 1, FS_TREE_METATABLE);
+
+	if (tree->fd >= 0) {
+		close(tree->fd);
+		tree->fd = -1;
+	}
+
+	return 0;
+}
+
+static void
+fs_pushtree(lua_State *L, int fd) {
+	struct fs_tree * const tree = lua_newuserdatauv(L, sizeof (*tree), 0);
+
+	tree->fd = fd;
+
+	if (luaL_newmetatable(L, FS_TREE_METATABLE)) {
+		lua_pushcfunction(L, fs_tree_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, fs_tree_gc);
+		lua_setfield(L, -2, "__close");
+	}
+	lua_setmetatable(L, -2);
+}
+
+static int
+fs_checktree(lua_State *L, int index, const char *function) {
+	const struct fs_tree * const tree = luaL_checkudata(L, index, FS_TREE_METATABLE);
+
+	if (tree->fd < 0) {
+		return luaL_error(L, "%s: Tree was closed", function);
+	}
+
+	return tree->fd;
+}
+
+#ifdef FS_MOUNT_API
+/* The mount API was merged over several releases, mount_setattr(2) last, on older
+ * kernels detached trees couldn't be given their flags, so the whole API is considered missing */
+static bool
+fs_mountapi(void) {
+	static int supported = -1;
+
+	if (supported < 0) {
+		supported = syscall(SYS_mount_setattr, -1, "", AT_EMPTY_PATH, NULL, 0) == 0 || errno != ENOSYS;
+	}
+
+	return supported;
+}
+#endif
+
+static int
+lua_fs_opentree(lua_State *L) {
+	const char * const path = luaL_checkstring(L, 1);
+	const bool recursive = lua_toboolean(L, 2);
+
+#ifdef FS_MOUNT_API
+	if (!fs_mountapi()) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	const int fd = syscall(SYS_open_tree, AT_FDCWD, path, OPEN_TREE_CLONE | OPEN_TREE_CLOEXEC | (recursive ? AT_RECURSIVE : 0));
+
+	if (fd < 0) {
+		/* Kernel predating the mount API, callers fall back to fs.mount */
+		if (errno == ENOSYS) {
+			lua_pushnil(L);
+			return 1;
+		}
+		return luaL_error(L, "fs.opentree: open_tree %s: %s", path, strerror(errno));
+	}
+
+	fs_pushtree(L, fd);
+#else
+	(void)path;
+	(void)recursive;
+	lua_pushnil(L);
+#endif
+
+	return 1;
+}
+
+static int
+lua_fs_fsmount(lua_State *L) {
+	const char * const filesystemtype = luaL_checkstring(L, 1);
+	const char * const source = luaL_optstring(L, 2, NULL);
+	const char * const opts = luaL_optstring(L, 3, NULL);
+
+#ifdef FS_MOUNT_API
+	const char *failed = NULL, *key = NULL;
+	int fd = -1;
+
+	if (!fs_mountapi()) {
+		lua_pushnil(L);
+		return 1;
+	}
+
+	const int fsfd = syscall(SYS_fsopen, filesystemtype, FSOPEN_CLOEXEC);
+	if (fsfd < 0) {
+		if (errno == ENOSYS) {
+			lua_pushnil(L);
+			return 1;
+		}
+		return luaL_error(L, "fs.fsmount: fsopen %s: %s", filesystemtype, strerror(errno));
+	}
+
+	if (source != NULL && *source != '\0'
+		&& syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, "source", source, 0) != 0) {
+		failed = "fsconfig";
+		key = "source";
+	}
+
+	/* Options are comma separated, either flags or key=value strings, as mount(8) options */
+	if (failed == NULL && opts != NULL) {
+		char buffer[strlen(opts) + 1], *saveptr;
+
+		strcpy(buffer, opts);
+		for (char *option = strtok_r(buffer, ",", &saveptr); option != NULL; option = strtok_r(NULL, ",", &saveptr)) {
+			char * const equal = strchr(option, '=');
+			int configval;
+
+			if (equal != NULL) {
+				*equal = '\0';
+				configval = syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_STRING, option, equal + 1, 0);
+			} else {
+				configval = syscall(SYS_fsconfig, fsfd, FSCONFIG_SET_FLAG, option, NULL, 0);
+			}
+
+			if (configval != 0) {
+				failed = "fsconfig";
+				key = lua_pushstring(L, option);
+				break;
+			}
+		}
+	}
+
+	if (failed == NULL && syscall(SYS_fsconfig, fsfd, FSCONFIG_CMD_CREATE, NULL, NULL, 0) != 0) {
+		failed = "fsconfig create";
+	}
+
+	if (failed == NULL && (fd = syscall(SYS_fsmount, fsfd, FSMOUNT_CLOEXEC, 0)) < 0) {
+		failed = "fsmount";
+	}
+
+	const int errcode = errno;
+	close(fsfd);
+
+	if (failed != NULL) {
+		return luaL_error(L, "fs.fsmount: %s %s%s%s: %s", failed, filesystemtype,
+			key != NULL ? " " : "", key != NULL ? key : "", strerror(errcode));
+	}
+
+	fs_pushtree(L, fd);
+#else
+	(void)filesystemtype;
+	(void)source;
+	(void)opts;
+	lua_pushnil(L);
+#endif
+
+	return 1;
+}
+
+static int
+lua_fs_mountattr(lua_State *L) {
+	const int fd = fs_checktree(L, 1, "fs.mountattr");
+
+#ifdef FS_MOUNT_API
+	static const struct mount_attributes {
+		const char *name;
+		const uint64_t set, clear, propagation;
+	} attributes[] = {
+		{ "rdonly",      MOUNT_ATTR_RDONLY,      0,                 0 },
+		{ "nosuid",      MOUNT_ATTR_NOSUID,      0,                 0 },
+		{ "nodev",       MOUNT_ATTR_NODEV,       0,                 0 },
+		{ "noexec",      MOUNT_ATTR_NOEXEC,      0,                 0 },
+		{ "nodiratime",  MOUNT_ATTR_NODIRATIME,  0,                 0 },
+		{ "relatime",    MOUNT_ATTR_RELATIME,    MOUNT_ATTR__ATIME, 0 },
+		{ "noatime",     MOUNT_ATTR_NOATIME,     MOUNT_ATTR__ATIME, 0 },
+		{ "strictatime", MOUNT_ATTR_STRICTATIME, MOUNT_ATTR__ATIME, 0 },
+		{ "private",     0,                      0,                 MS_PRIVATE },
+		{ "slave",       0,                      0,                 MS_SLAVE },
+		{ "shared",      0,                      0,                 MS_SHARED },
+		{ "unbindable",  0,                      0,                 MS_UNBINDABLE },
+	};
+	const struct mount_attributes * const attributesend = attributes + sizeof (attributes) / sizeof (*attributes);
+	struct fs_mount_attr attr = { 0 };
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	/* Names of fs.mount flags which aren't attributes are ignored, so mountpoints flags can be given as is */
+	for (int i = 1; lua_rawgeti(L, 2, i) == LUA_TSTRING; i++) {
+		const char * const name = lua_tostring(L, -1);
+		const struct mount_attributes *current = attributes;
+
+		while (current != attributesend && strcmp(current->name, name) != 0) {
+			current++;
+		}
+
+		if (current != attributesend) {
+			attr.attr_set |= current->set;
+			attr.attr_clr |= current->clear;
+			if (current->propagation != 0) {
+				attr.propagation = current->propagation;
+			}
+		}
+
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	if ((attr.attr_set != 0 || attr.attr_clr != 0 || attr.propagation != 0)
+		&& syscall(SYS_mount_setattr, fd, "", AT_EMPTY_PATH | AT_RECURSIVE, &attr, sizeof (attr)) != 0) {
+		return luaL_error(L, "fs.mountattr: mount_setattr: %s", strerror(errno));
+	}
+#else
+	(void)fd;
+	return luaL_error(L, "fs.mountattr: Mount trees are not supported on this platform");
+#endif
+
+	return 0;
+}
+
+static int
+lua_fs_movemount(lua_State *L) {
+	const int fd = fs_checktree(L, 1, "fs.movemount");
+	const char * const target = luaL_checkstring(L, 2);
+
+#ifdef FS_MOUNT_API
+	if (syscall(SYS_move_mount, fd, "", AT_FDCWD, target, MOVE_MOUNT_F_EMPTY_PATH) != 0) {
+		return luaL_error(L, "fs.movemount: move_mount %s: %s", target, strerror(errno));
+	}
+#else
+	(void)fd;
+	return luaL_error(L, "fs.movemount: Mount trees are not supported on this platform");
+#endif
+
+	return 0;
+}
+
 static int
 lua_fs_pwd(lua_State *L) {
 	bool toosmall = true;
@@ -592,6 +1540,60 @@ lua_fs_chroot(lua_State *L) {
 	return 0;
 }
 
+static int
+lua_fs_pivotroot(lua_State *L) {
+	const char * const path = luaL_checkstring(L, 1);
+
+#if defined(__linux__) && defined(SYS_pivot_root)
+	char root[PATH_MAX], cwd[PATH_MAX];
+	const char *failed = NULL;
+
+	/* The working directory is translated under the new root, the old one being detached */
+	if (realpath(path, root) == NULL) {
+		return luaL_error(L, "fs.pivotroot: realpath %s: %s", path, strerror(errno));
+	}
+
+	if (getcwd(cwd, sizeof (cwd)) == NULL) {
+		return luaL_error(L, "fs.pivotroot: getcwd: %s", strerror(errno));
+	}
+
+	/* pivot_root(2) affects every process sharing the mount namespace, a private copy is pivoted.
+	 * The new root must be a mountpoint, so it is bound onto itself, with its own mountpoints */
+	if (unshare(CLONE_NEWNS) != 0) {
+		failed = "unshare";
+	} else if (mount(NULL, "/", NULL, MS_REC | MS_PRIVATE, NULL) != 0) {
+		failed = "mount private";
+	} else if (mount(path, path, NULL, MS_BIND | MS_REC, NULL) != 0) {
+		failed = "mount bind";
+	} else if (chdir(path) != 0) {
+		failed = "chdir";
+	} else if (syscall(SYS_pivot_root, ".", ".") != 0) {
+		failed = "pivot_root";
+	} else if (umount2(".", MNT_DETACH) != 0) {
+		/* Old root is stacked over the new one */
+		failed = "umount2";
+	}
+
+	if (failed != NULL) {
+		return luaL_error(L, "fs.pivotroot: %s %s: %s", failed, path, strerror(errno));
+	}
+
+	/* Outside of the new root, nothing is left to reach, the root itself is used */
+	const size_t rootlen = strcmp(root, "/") == 0 ? 0 : strlen(root);
+	const char * const relative = strncmp(cwd, root, rootlen) == 0 && cwd[rootlen] == '/' ? cwd + rootlen : "/";
+
+	if (chdir(relative) != 0) {
+		return luaL_error(L, "fs.pivotroot: chdir %s: %s", relative, strerror(errno));
+	}
+#else
+	if (chroot(path) != 0) {
+		return luaL_error(L, "fs.pivotroot: chroot %s: %s", path, strerror(errno));
+	}
+#endif
+
+	return 0;
+}
+
 static int
 lua_fs_dirname(lua_State *L) {
 	size_t length;
@@ -617,20 +1619,30 @@ lua_fs_basename(lua_State *L) {
 }
 
 static const luaL_Reg fs_funcs[] = {
-	{ "isreg",    lua_fs_isreg },
-	{ "isdir",    lua_fs_isdir },
-	{ "isexe",    lua_fs_isexe },
-	{ "copy",     lua_fs_copy },
-	{ "remove",   lua_fs_remove },
-	{ "mkdirs",   lua_fs_mkdirs },
-	{ "mount",    lua_fs_mount },
-	{ "umount",   lua_fs_umount },
-	{ "pwd",      lua_fs_pwd },
-	{ "path",     lua_fs_path },
-	{ "chdir",    lua_fs_chdir },
-	{ "chroot",   lua_fs_chroot },
-	{ "dirname",  lua_fs_dirname },
-	{ "basename", lua_fs_basename },
+	{ "isreg",       lua_fs_isreg },
+	{ "isdir",       lua_fs_isdir },
+	{ "isexe",       lua_fs_isexe },
+	{ "fingerprint", lua_fs_fingerprint },
+	{ "copy",        lua_fs_copy },
+	{ "read",        lua_fs_read },
+	{ "write",       lua_fs_write },
+	{ "replace",     lua_fs_replace },
+	{ "remove",      lua_fs_remove },
+	{ "rmdir",       lua_fs_rmdir },
+	{ "mkdirs",      lua_fs_mkdirs },
+	{ "mount",       lua_fs_mount },
+	{ "umount",      lua_fs_umount },
+	{ "opentree",    lua_fs_opentree },
+	{ "fsmount",     lua_fs_fsmount },
+	{ "mountattr",   lua_fs_mountattr },
+	{ "movemount",   lua_fs_movemount },
+	{ "pwd",         lua_fs_pwd },
+	{ "path",        lua_fs_path },
+	{ "chdir",       lua_fs_chdir },
+	{ "chroot",      lua_fs_chroot },
+	{ "pivotroot",   lua_fs_pivotroot },
+	{ "dirname",     lua_fs_dirname },
+	{ "basename",    lua_fs_basename },
 	{ NULL, NULL }
 };
 
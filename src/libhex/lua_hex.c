@@ -1,17 +1,41 @@
 #define _GNU_SOURCE
 #include "hex/lua.h"
+#include "digest.h"
+#include "scribe.h"
 
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/file.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
 #include <alloca.h>
 #include <fcntl.h>
 #include <sched.h>
+#include <spawn.h>
+#include <signal.h>
+#include <poll.h>
+#include <time.h>
 #include <errno.h>
 
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+/* Self-pipe written on SIGCHLD, so hex.reap can wait for
+ * both summoned processes and other file descriptors */
+static int hex_sigchld_fds[2] = { -1, -1 };
+
+/* Make compatible jobserver, fds are inherited by every child,
+ * reader is hex's own non-blocking reading end to acquire tokens */
+static struct hex_jobserver {
+	int fds[2];
+	int reader;
+} hex_jobserver = { { -1, -1 }, -1 };
+
 static int
 lua_hex_exit(lua_State *L) {
 	static const char *statuses[] = {
@@ -72,24 +96,376 @@ hex_unpack_arguments(lua_State *L) {
 	return top;
 }
 
+/* Pushes the location of the Lua code calling the running function, as luaL_where(L, 1),
+ * but skipping C functions calling it in between, such as the wrappers of hex(1)'s profiler */
 static void
-hex_wait_pid(lua_State *L, const char *enchantment, pid_t pid) {
-	int status;
+hex_where(lua_State *L) {
+	lua_Debug ar;
 
-	/* Wait for process termination, and fail if failure */
-	waitpid(pid, &status, 0);
+	for (int level = 1; lua_getstack(L, level, &ar) != 0; level++) {
+		lua_getinfo(L, "Sl", &ar);
+
+		if (*ar.what != 'C') {
+			if (ar.currentline > 0) {
+				lua_pushfstring(L, "%s:%d: ", ar.short_src, ar.currentline);
+				return;
+			}
+			break;
+		}
+	}
+
+	lua_pushliteral(L, "");
+}
+
+static int
+hex_push_status(lua_State *L, const char *enchantment, int status) {
 
+	/* Push a message describing the failure, if status is one */
 	if (WIFSIGNALED(status)) {
 		const int signo = WTERMSIG(status);
-		luaL_error(L, "%s: Terminated with signal %d (%s)", enchantment, signo, strsignal(signo));
+		lua_pushfstring(L, "%s: Terminated with signal %d (%s)", enchantment, signo, strsignal(signo));
+		return 1;
 	}
 
 	if (WIFEXITED(status)) {
 		const int exitstatus = WEXITSTATUS(status);
 		if (exitstatus != 0) {
-			luaL_error(L, "%s: Exited with code %d", enchantment, exitstatus);
+			lua_pushfstring(L, "%s: Exited with code %d", enchantment, exitstatus);
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+static void
+hex_sigchld(int signo) {
+	const int errcode = errno;
+
+	/* Non-blocking, if the pipe is full, hex.reap will be woken anyway */
+	write(hex_sigchld_fds[1], "", 1);
+
+	errno = errcode;
+}
+
+static void
+hex_sigchld_setup(lua_State *L, const char *enchantment) {
+
+	if (hex_sigchld_fds[0] < 0) {
+		struct sigaction action = {
+			.sa_handler = hex_sigchld,
+			.sa_flags = SA_RESTART | SA_NOCLDSTOP,
+		};
+
+		if (pipe(hex_sigchld_fds) != 0) {
+			luaL_error(L, "%s: pipe: %s", enchantment, strerror(errno));
+		}
+
+		for (int i = 0; i < 2; i++) {
+			fcntl(hex_sigchld_fds[i], F_SETFD, FD_CLOEXEC);
+			fcntl(hex_sigchld_fds[i], F_SETFL, O_NONBLOCK);
+		}
+
+		sigemptyset(&action.sa_mask);
+		if (sigaction(SIGCHLD, &action, NULL) != 0) {
+			luaL_error(L, "%s: sigaction: %s", enchantment, strerror(errno));
+		}
+	}
+}
+
+static void
+hex_sigchld_reset(void) {
+
+	/* A summoned process has no use of its parent's handler nor self-pipe */
+	if (hex_sigchld_fds[0] >= 0) {
+		signal(SIGCHLD, SIG_DFL);
+		close(hex_sigchld_fds[0]);
+		close(hex_sigchld_fds[1]);
+		hex_sigchld_fds[0] = -1;
+		hex_sigchld_fds[1] = -1;
+	}
+}
+
+/* Process groups of running children, signaled along with hex when it is interrupted.
+ * Only catchable signals are forwarded: if hex is killed, e.g. with SIGKILL as a timed out
+ * invocation of another hex, the groups it created are left running and reparented */
+static struct hex_groups {
+	pid_t *pgids;
+	size_t count, capacity;
+} hex_groups;
+
+static const int hex_groups_signals[] = { SIGHUP, SIGINT, SIGQUIT, SIGTERM };
+
+static void
+hex_groups_forward(int signo) {
+
+	for (size_t i = 0; i < hex_groups.count; i++) {
+		kill(-hex_groups.pgids[i], signo);
+	}
+
+	/* Delivered once the handler returns */
+	signal(signo, SIG_DFL);
+	raise(signo);
+}
+
+/* Blocks or unblocks forwarded signals while the groups are modified */
+static void
+hex_groups_mask(int how) {
+	sigset_t set;
+
+	sigemptyset(&set);
+	for (size_t i = 0; i < sizeof (hex_groups_signals) / sizeof (*hex_groups_signals); i++) {
+		sigaddset(&set, hex_groups_signals[i]);
+	}
+
+	sigprocmask(how, &set, NULL);
+}
+
+/* Ensures a process group can be added without failing, must be called before creating it */
+static void
+hex_groups_reserve(lua_State *L, const char *enchantment) {
+
+	if (hex_groups.capacity == 0) {
+		struct sigaction action = { .sa_handler = hex_groups_forward };
+
+		sigemptyset(&action.sa_mask);
+		for (size_t i = 0; i < sizeof (hex_groups_signals) / sizeof (*hex_groups_signals); i++) {
+			struct sigaction previous;
+
+			/* Ignored signals, as set by nohup(1), stay ignored */
+			if (sigaction(hex_groups_signals[i], NULL, &previous) == 0 && previous.sa_handler != SIG_IGN) {
+				sigaction(hex_groups_signals[i], &action, NULL);
+			}
+		}
+	}
+
+	if (hex_groups.count == hex_groups.capacity) {
+		const size_t capacity = hex_groups.capacity == 0 ? 8 : hex_groups.capacity * 2;
+
+		hex_groups_mask(SIG_BLOCK);
+		pid_t * const pgids = realloc(hex_groups.pgids, capacity * sizeof (*pgids));
+		if (pgids != NULL) {
+			hex_groups.pgids = pgids;
+			hex_groups.capacity = capacity;
+		}
+		hex_groups_mask(SIG_UNBLOCK);
+
+		if (pgids == NULL) {
+			luaL_error(L, "%s: realloc: %s", enchantment, strerror(errno));
+		}
+	}
+}
+
+static void
+hex_groups_add(pid_t pgid) {
+	hex_groups_mask(SIG_BLOCK);
+	hex_groups.pgids[hex_groups.count++] = pgid;
+	hex_groups_mask(SIG_UNBLOCK);
+}
+
+static void
+hex_groups_remove(pid_t pgid) {
+
+	for (size_t i = 0; i < hex_groups.count; i++) {
+		if (hex_groups.pgids[i] == pgid) {
+			hex_groups_mask(SIG_BLOCK);
+			hex_groups.pgids[i] = hex_groups.pgids[--hex_groups.count];
+			hex_groups_mask(SIG_UNBLOCK);
+			break;
+		}
+	}
+}
+
+static double
+hex_now(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Returns hex.timeout if it's a number, and sets grace to hex.grace, a negative value else */
+static double
+hex_timeout(lua_State *L, double *grace) {
+	double timeout = -1;
+
+	lua_getglobal(L, "hex");
+	lua_getfield(L, -1, "timeout");
+	lua_getfield(L, -2, "grace");
+	if (lua_isnumber(L, -2)) {
+		timeout = lua_tonumber(L, -2);
+		*grace = luaL_optnumber(L, -1, 10);
+	}
+	lua_pop(L, 3);
+
+	return timeout;
+}
+
+/* Waits at most seconds for the process, through its pidfd if valid,
+ * else through the SIGCHLD self-pipe. Returns 1 if it was reaped, 0 if it
+ * still runs after seconds, or -1 with errno set if it can't be waited for */
+static int
+hex_wait_deadline(pid_t pid, int pidfd, double seconds, int *statusp, struct rusage *usage) {
+	const double deadline = hex_now() + seconds;
+
+	while (true) {
+		pid_t reaped;
+
+		while (reaped = wait4(pid, statusp, WNOHANG, usage), reaped < 0 && errno == EINTR);
+
+		/* Reaped by someone else, the status is lost */
+		if (reaped < 0) {
+			return -1;
+		}
+
+		if (reaped != 0) {
+			return 1;
+		}
+
+		const double left = deadline - hex_now();
+		if (left <= 0) {
+			return 0;
+		}
+
+		struct pollfd fds = { .fd = pidfd >= 0 ? pidfd : hex_sigchld_fds[0], .events = POLLIN };
+		if (poll(&fds, 1, left * 1000 + 1) > 0 && pidfd < 0) {
+			char buffer[64];
+			while (read(hex_sigchld_fds[0], buffer, sizeof (buffer)) > 0);
+		}
+	}
+}
+
+/* Pushes a table of the resources used by a terminated process and its waited descendants */
+static void
+hex_push_usage(lua_State *L, const struct rusage *usage) {
+#ifdef __APPLE__
+	const lua_Integer maxrss = usage->ru_maxrss;
+#else
+	const lua_Integer maxrss = (lua_Integer)usage->ru_maxrss * 1024;
+#endif
+
+	lua_createtable(L, 0, 7);
+	lua_pushnumber(L, usage->ru_utime.tv_sec + usage->ru_utime.tv_usec / 1000000.0);
+	lua_setfield(L, -2, "user");
+	lua_pushnumber(L, usage->ru_stime.tv_sec + usage->ru_stime.tv_usec / 1000000.0);
+	lua_setfield(L, -2, "system");
+	lua_pushinteger(L, maxrss);
+	lua_setfield(L, -2, "maxrss");
+	lua_pushinteger(L, usage->ru_nvcsw);
+	lua_setfield(L, -2, "voluntary");
+	lua_pushinteger(L, usage->ru_nivcsw);
+	lua_setfield(L, -2, "involuntary");
+	lua_pushinteger(L, usage->ru_inblock);
+	lua_setfield(L, -2, "inblock");
+	lua_pushinteger(L, usage->ru_oublock);
+	lua_setfield(L, -2, "oublock");
+}
+
+/* Waits until the scribe capturing into filename is done, it holds a lock on its output until then.
+ * Returns 0 if done or if nothing was ever captured into filename, -1 with errno set on failure */
+static int
+hex_capture_wait(const char *filename) {
+	const size_t filenamelen = strlen(filename);
+	char path[filenamelen + sizeof (SCRIBE_SUFFIX)];
+
+	memcpy(stpcpy(path, filename), SCRIBE_SUFFIX, sizeof (SCRIBE_SUFFIX));
+	const int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return errno == ENOENT ? 0 : -1;
+	}
+
+	int flockval;
+	while (flockval = flock(fd, LOCK_SH), flockval != 0 && errno == EINTR);
+
+	const int errcode = errno;
+	close(fd);
+	errno = errcode;
+
+	return flockval;
+}
+
+/* Waits for the process, raises an error if it failed, else pushes its resources usage.
+ * If timeout isn't negative, the process leads its own registered process group, which is
+ * terminated once timeout seconds elapsed, and killed if still running after grace seconds.
+ * If program isn't NULL, the process executed it and is reported with report.cast.
+ * If captured isn't NULL, the process' output was captured into it, and is complete once this returns */
+static void
+hex_wait_pid(lua_State *L, const char *enchantment, pid_t pid, double timeout, double grace,
+	const char *program, const char *captured) {
+	const double start = hex_now();
+	bool timedout = false;
+	struct rusage usage;
+	int status, waited, errcode;
+
+	/* Wait for process termination, and fail if failure */
+	if (timeout < 0) {
+		while (waited = wait4(pid, &status, 0, &usage), waited < 0 && errno == EINTR);
+		errcode = errno;
+	} else {
+		int pidfd = -1;
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+		pidfd = syscall(SYS_pidfd_open, pid, 0);
+#endif
+
+		waited = hex_wait_deadline(pid, pidfd, timeout, &status, &usage);
+		timedout = waited == 0;
+
+		if (timedout) {
+			kill(-pid, SIGTERM);
+			waited = hex_wait_deadline(pid, pidfd, grace, &status, &usage);
+			if (waited == 0) {
+				kill(-pid, SIGKILL);
+				while (waited = wait4(pid, &status, 0, &usage), waited < 0 && errno == EINTR);
+			}
+		}
+		errcode = errno;
+
+		if (pidfd >= 0) {
+			close(pidfd);
 		}
+
+		hex_groups_remove(pid);
+	}
+
+	/* Its scribe stops once it terminated, whatever the outcome */
+	if (captured != NULL) {
+		hex_capture_wait(captured);
+	}
+
+	/* Reaped by someone else, its status is lost, it can't be told it succeeded */
+	if (waited < 0) {
+		luaL_error(L, "%s: wait4 %d: %s", enchantment, (int)pid, strerror(errcode));
+	}
+
+	if (program != NULL) {
+		lua_getglobal(L, "report");
+		lua_getfield(L, -1, "cast");
+		lua_pushstring(L, program);
+		lua_pushnumber(L, hex_now() - start);
+		lua_call(L, 2, 0);
+		lua_pop(L, 1);
+	}
+
+	if (timedout) {
+		char elapsed[32];
+
+		snprintf(elapsed, sizeof (elapsed), "%.1fs", timeout);
+		hex_where(L);
+		lua_pushfstring(L, "%s: Timed out after %s", enchantment, elapsed);
+		lua_concat(L, 2);
+		lua_error(L);
+	}
+
+	if (hex_push_status(L, enchantment, status) != 0) {
+		hex_where(L);
+		lua_rotate(L, -2, 1);
+		lua_concat(L, 2);
+		lua_error(L);
 	}
+
+	hex_push_usage(L, &usage);
 }
 
 static void
@@ -112,173 +488,1017 @@ hex_print_command(lua_State *L, int top, char **argv) {
 			fputc(' ', stdout);
 			i++;
 		}
-		fputs(argv[i], stdout);
-		fputc('\n', stdout);
-		fflush(stdout);
+		fputs(argv[i], stdout);
+		fputc('\n', stdout);
+		fflush(stdout);
+	}
+}
+
+/* Spawns argv without duplicating hex's address space, so its cost doesn't grow with
+ * the interpreter's heap. If output is valid, it replaces the standard output of the process,
+ * both output and unused, the caller's end of a pipe, are closed in the process.
+ * If group is set, the process leads a new process group.
+ * Returns zero on success, an error number else. */
+static int
+hex_spawn(pid_t *pidp, char **argv, int output, int unused, bool group) {
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attributes;
+	int errcode = posix_spawn_file_actions_init(&actions);
+
+	if (errcode != 0) {
+		return errcode;
+	}
+
+	errcode = posix_spawnattr_init(&attributes);
+	if (errcode != 0) {
+		posix_spawn_file_actions_destroy(&actions);
+		return errcode;
+	}
+
+	if ((!group
+			|| ((errcode = posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP)) == 0
+				&& (errcode = posix_spawnattr_setpgroup(&attributes, 0)) == 0))
+		&& (output < 0
+			|| ((errcode = posix_spawn_file_actions_adddup2(&actions, output, STDOUT_FILENO)) == 0
+				&& (errcode = posix_spawn_file_actions_addclose(&actions, output)) == 0
+				&& (errcode = posix_spawn_file_actions_addclose(&actions, unused)) == 0))) {
+		errcode = posix_spawnp(pidp, *argv, &actions, &attributes, argv, environ);
+	}
+
+	posix_spawnattr_destroy(&attributes);
+	posix_spawn_file_actions_destroy(&actions);
+
+	return errcode;
+}
+
+static int
+lua_hex_cast(lua_State *L) {
+	const int top = hex_unpack_arguments(L);
+	char *argv[top + 1];
+
+	/* Fill argv */
+	for (int i = 0; i < top; i++) {
+		size_t length;
+		const char *arg = luaL_checklstring(L, i + 1, &length);
+		argv[i] = strncpy(alloca(length + 1), arg, length + 1);
+	}
+	argv[top] = NULL;
+
+	hex_print_command(L, top, argv);
+
+	double grace;
+	const double timeout = hex_timeout(L, &grace);
+	if (timeout >= 0) {
+		hex_sigchld_setup(L, "hex.cast");
+		hex_groups_reserve(L, "hex.cast");
+	}
+
+	pid_t pid;
+	const int errcode = hex_spawn(&pid, argv, -1, -1, timeout >= 0);
+	if (errcode != 0) {
+		return luaL_error(L, "hex.cast: posix_spawnp %s: %s", *argv, strerror(errcode));
+	}
+
+	if (timeout >= 0) {
+		hex_groups_add(pid);
+	}
+
+	hex_wait_pid(L, "hex.cast", pid, timeout, grace, *argv, NULL);
+
+	return 1;
+}
+
+static int
+lua_hex_charm(lua_State *L) {
+	const int top = hex_unpack_arguments(L);
+	char *argv[top + 1];
+
+	/* Fill argv */
+	for (int i = 0; i < top; i++) {
+		size_t length;
+		const char *arg = luaL_checklstring(L, i + 1, &length);
+		argv[i] = strncpy(alloca(length + 1), arg, length + 1);
+	}
+	argv[top] = NULL;
+
+	/* Until here, it was the exact same call as lua_hex_cast, but we will redirect
+	the new process STOUT_FILENO in a pipe and retrieve its value in a lua buffer */
+	int filedes[2];
+
+	if (pipe(filedes) != 0) {
+		return luaL_error(L, "hex.charm: pipe: %s", strerror(errno));
+	}
+
+	pid_t pid;
+	const int spawnerrcode = hex_spawn(&pid, argv, filedes[1], filedes[0], false);
+
+	close(filedes[1]);
+
+	if (spawnerrcode != 0) {
+		close(filedes[0]);
+		return luaL_error(L, "hex.charm: posix_spawnp %s: %s", *argv, strerror(spawnerrcode));
+	}
+
+	luaL_Buffer b;
+
+	luaL_buffinit(L, &b);
+
+	char *buffer;
+	ssize_t readval;
+	while (buffer = luaL_prepbuffer(&b), readval = read(filedes[0], buffer, LUAL_BUFFERSIZE), readval > 0) {
+		luaL_addsize(&b, readval);
+	}
+
+	const int errcode = errno;
+
+	close(filedes[0]);
+
+	if (readval < 0) {
+		return luaL_error(L, "hex.charm: read: %s", strerror(errcode));
+	}
+
+	const size_t len = luaL_bufflen(&b);
+	if (len != 0 && luaL_buffaddr(&b)[len - 1] == '\n') {
+		luaL_buffsub(&b, 1);
+	}
+
+	luaL_pushresult(&b);
+
+	hex_wait_pid(L, "hex.charm", pid, -1, 0, *argv, NULL);
+	lua_pop(L, 1);
+
+	return 1;
+}
+
+#define HEX_LINES_METATABLE "hex.lines"
+
+/* Pipe of a process spawned by hex.lines, and the lines read but not yet iterated */
+struct hex_lines {
+	pid_t pid;
+	int fd;
+	char *buffer;
+	size_t start, end, capacity;
+};
+
+/* Closes the pipe and reaps the process, returns its status if it was still reapable, -1 else */
+static int
+hex_lines_close(struct hex_lines *lines) {
+	int status = -1;
+
+	if (lines->fd >= 0) {
+		close(lines->fd);
+		lines->fd = -1;
+	}
+
+	if (lines->pid > 0) {
+		/* If the loop was broken, the process is stopped by SIGPIPE on its next write */
+		if (waitpid(lines->pid, &status, 0) < 0) {
+			status = -1;
+		}
+		lines->pid = -1;
+	}
+
+	free(lines->buffer);
+	lines->buffer = NULL;
+
+	return status;
+}
+
+static int
+hex_lines_gc(lua_State *L) {
+
+	hex_lines_close(luaL_checkudata(L, 1, HEX_LINES_METATABLE));
+
+	return 0;
+}
+
+static int
+hex_lines_iterate(lua_State *L) {
+	struct hex_lines * const lines = luaL_checkudata(L, lua_upvalueindex(1), HEX_LINES_METATABLE);
+
+	while (lines->fd >= 0) {
+		char * const begin = lines->buffer + lines->start;
+		char * const newline = memchr(begin, '\n', lines->end - lines->start);
+
+		if (newline != NULL) {
+			lua_pushlstring(L, begin, newline - begin);
+			lines->start = newline - lines->buffer + 1;
+			return 1;
+		}
+
+		/* Move the partial line at the beginning, grow only if it fills the whole buffer */
+		if (lines->start != 0) {
+			memmove(lines->buffer, begin, lines->end - lines->start);
+			lines->end -= lines->start;
+			lines->start = 0;
+		}
+
+		if (lines->end == lines->capacity) {
+			const size_t capacity = lines->capacity * 2;
+			char * const buffer = realloc(lines->buffer, capacity);
+
+			if (buffer == NULL) {
+				return luaL_error(L, "hex.lines: realloc: %s", strerror(errno));
+			}
+
+			lines->buffer = buffer;
+			lines->capacity = capacity;
+		}
+
+		const ssize_t readval = read(lines->fd, lines->buffer + lines->end, lines->capacity - lines->end);
+
+		if (readval > 0) {
+			lines->end += readval;
+		} else if (readval == 0) {
+			/* Last line may not be terminated by a line delimiter */
+			if (lines->end != 0) {
+				lua_pushlstring(L, lines->buffer, lines->end);
+				lines->end = 0;
+				return 1;
+			}
+
+			close(lines->fd);
+			lines->fd = -1;
+		} else if (errno != EINTR) {
+			return luaL_error(L, "hex.lines: read: %s", strerror(errno));
+		}
+	}
+
+	/* Output exhausted, fail as hex.charm would if the process failed */
+	if (lines->pid > 0) {
+		const int status = hex_lines_close(lines);
+
+		if (status != -1 && hex_push_status(L, "hex.lines", status) != 0) {
+			hex_where(L);
+			lua_rotate(L, -2, 1);
+			lua_concat(L, 2);
+			return lua_error(L);
+		}
+	}
+
+	return 0;
+}
+
+static int
+lua_hex_lines(lua_State *L) {
+	const int top = hex_unpack_arguments(L);
+	char *argv[top + 1];
+
+	/* Fill argv */
+	for (int i = 0; i < top; i++) {
+		size_t length;
+		const char *arg = luaL_checklstring(L, i + 1, &length);
+		argv[i] = strncpy(alloca(length + 1), arg, length + 1);
+	}
+	argv[top] = NULL;
+
+	/* Userdata first, so its finalizer reaps the process whatever happens next */
+	struct hex_lines * const lines = lua_newuserdatauv(L, sizeof (*lines), 0);
+	lines->pid = -1;
+	lines->fd = -1;
+	lines->start = 0;
+	lines->end = 0;
+	lines->capacity = LUAL_BUFFERSIZE;
+	lines->buffer = malloc(lines->capacity);
+
+	if (luaL_newmetatable(L, HEX_LINES_METATABLE)) {
+		lua_pushcfunction(L, hex_lines_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, hex_lines_gc);
+		lua_setfield(L, -2, "__close");
+	}
+	lua_setmetatable(L, -2);
+
+	if (lines->buffer == NULL) {
+		return luaL_error(L, "hex.lines: malloc: %s", strerror(errno));
+	}
+
+	int filedes[2];
+
+	if (pipe(filedes) != 0) {
+		return luaL_error(L, "hex.lines: pipe: %s", strerror(errno));
+	}
+
+	const int errcode = hex_spawn(&lines->pid, argv, filedes[1], filedes[0], false);
+
+	close(filedes[1]);
+
+	if (errcode != 0) {
+		close(filedes[0]);
+		lines->pid = -1;
+		return luaL_error(L, "hex.lines: posix_spawnp %s: %s", *argv, strerror(errcode));
+	}
+
+	lines->fd = filedes[0];
+
+	/* Iterator, state, initial value and closing value of a generic for */
+	lua_pushvalue(L, -1);
+	lua_pushcclosure(L, hex_lines_iterate, 1);
+	lua_pushnil(L);
+	lua_pushnil(L);
+	lua_rotate(L, -4, -1);
+
+	return 4;
+}
+
+/* Redirects the process' output to a scribe process writing into filename. The scribe is locking
+ * its output until it's done, it stops once the process terminated, even if writers are left running */
+static void
+hex_scribe_start(const char *filename, size_t limit, size_t tail) {
+	const size_t filenamelen = strlen(filename);
+	char path[filenamelen + sizeof (SCRIBE_SUFFIX)];
+	const pid_t parent = getpid();
+	int filedes[2];
+
+	/* Locked before the scribe exists, so no waiter can see its output unlocked before it's done */
+	memcpy(stpcpy(path, filename), SCRIBE_SUFFIX, sizeof (SCRIBE_SUFFIX));
+	const int output = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (output < 0 || flock(output, LOCK_EX) != 0) {
+		fprintf(stderr, "open %s: %s\n", path, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (pipe(filedes) != 0) {
+		fprintf(stderr, "pipe %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	const pid_t pid = fork();
+	switch (pid) {
+	case 0:
+		/* Out of the invocation's process group, so the output is
+		 * still written once the group was terminated */
+		setpgid(0, 0);
+		close(filedes[1]);
+		_exit(scribe_run(filedes[0], output, parent, filename, limit, tail));
+	case -1:
+		fprintf(stderr, "fork %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	default:
+		break;
+	}
+
+	/* The lock now belongs to the scribe only */
+	close(output);
+	close(filedes[0]);
+
+	if (dup2(filedes[1], STDOUT_FILENO) != STDOUT_FILENO) {
+		fprintf(stderr, "dup2 (stdout) %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	if (dup2(filedes[1], STDERR_FILENO) != STDERR_FILENO) {
+		fprintf(stderr, "dup2 (stderr) %s: %s\n", filename, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	close(filedes[1]);
+}
+
+static pid_t
+hex_invoke_fork(lua_State *L, const char *enchantment, bool group) {
+	size_t outputlen;
+	const char *output = lua_tolstring(L, -1, &outputlen);
+	lua_Integer limit = 0, tail = 0;
+	bool capture = false;
+	char *filename;
+
+	/* We have no lua GC's guarantee that after lua_pop, output
+	 * will still be valid. So we create a local copy */
+	if (output != NULL) {
+		filename = alloca(outputlen + 1);
+		strncpy(filename, output, outputlen + 1);
+		lua_pop(L, 1);
+
+		/* Output is captured by a scribe, unless hex.capture isn't a table */
+		const int top = lua_gettop(L);
+		lua_getglobal(L, "hex");
+		if (lua_getfield(L, -1, "capture") == LUA_TTABLE) {
+			lua_getfield(L, -1, "limit");
+			lua_getfield(L, -2, "tail");
+			limit = luaL_optinteger(L, -2, 64 * 1024 * 1024);
+			tail = luaL_optinteger(L, -1, 64 * 1024);
+			capture = limit >= 0 && tail >= 0;
+		}
+		lua_settop(L, top);
+	} else {
+		filename = NULL;
+	}
+
+	if (group) {
+		hex_groups_reserve(L, enchantment);
+	}
+
+	const int top = hex_unpack_arguments(L);
+	const pid_t pid = fork();
+
+	switch (pid) {
+	case 0:
+		hex_sigchld_reset();
+		/* Our parent's groups are none of our business */
+		hex_groups.count = 0;
+
+		if (group) {
+			setpgid(0, 0);
+		}
+
+		if (capture) {
+			hex_scribe_start(filename, limit, tail);
+		} else if (filename != NULL) {
+			/* Output redirection into a file */
+			int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+
+			if (fd < 0) {
+				fprintf(stderr, "open %s: %s\n", filename, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			if (dup2(fd, STDOUT_FILENO) != STDOUT_FILENO) {
+				fprintf(stderr, "dup2 (stdout) %s: %s\n", filename, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			if (dup2(fd, STDERR_FILENO) != STDERR_FILENO) {
+				fprintf(stderr, "dup2 (stderr) %s: %s\n", filename, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+
+			close(fd);
+		}
+
+		for (int i = 1; i <= top; i++) {
+			/* We guarantee the first argument to be the first one
+			executed, so each new argument is rotated on the top to be directly
+			removed after its call */
+			lua_rotate(L, 1, -1);
+			lua_call(L, 0, 0);
+		}
+		exit(EXIT_SUCCESS);
+	case -1:
+		return luaL_error(L, "%s: fork: %s", enchantment, strerror(errno));
+	default:
+		break;
+	}
+
+	/* Also set by the parent, so it's done before anyone signals the group */
+	if (group) {
+		setpgid(pid, pid);
+		hex_groups_add(pid);
+	}
+
+	return pid;
+}
+
+static int
+lua_hex_invoke(lua_State *L) {
+	double grace;
+	const double timeout = hex_timeout(L, &grace);
+
+	if (timeout >= 0) {
+		hex_sigchld_setup(L, "hex.invoke");
+	}
+
+	/* A copy, the filename isn't guaranteed to outlive its pop from the stack */
+	const char *output = lua_type(L, -1) == LUA_TSTRING ? lua_tostring(L, -1) : NULL;
+	char * const captured = output != NULL ? strcpy(alloca(strlen(output) + 1), output) : NULL;
+
+	const pid_t pid = hex_invoke_fork(L, "hex.invoke", timeout >= 0);
+
+	hex_wait_pid(L, "hex.invoke", pid, timeout, grace, NULL, captured);
+
+	return 1;
+}
+
+static int
+lua_hex_summon(lua_State *L) {
+	hex_sigchld_setup(L, "hex.summon");
+
+	const pid_t pid = hex_invoke_fork(L, "hex.summon", true);
+
+	lua_pushinteger(L, pid);
+
+	return 1;
+}
+
+static int
+lua_hex_captured(lua_State *L) {
+	const char * const filename = luaL_checkstring(L, 1);
+
+	if (hex_capture_wait(filename) != 0) {
+		return luaL_error(L, "hex.captured: flock %s: %s", filename, strerror(errno));
+	}
+
+	return 0;
+}
+
+static int
+lua_hex_terminate(lua_State *L) {
+	const pid_t pid = luaL_checkinteger(L, 1);
+	const int signo = lua_toboolean(L, 2) ? SIGKILL : SIGTERM;
+
+	/* The group may have already terminated */
+	if (kill(-pid, signo) != 0 && errno != ESRCH) {
+		return luaL_error(L, "hex.terminate: kill %d: %s", (int)pid, strerror(errno));
+	}
+
+	return 0;
+}
+
+static int
+lua_hex_reap(lua_State *L) {
+	const int wake = lua_toboolean(L, 1) && hex_jobserver.reader >= 0;
+	const double timeout = luaL_optnumber(L, 2, -1);
+	const double deadline = hex_now() + timeout;
+	struct rusage usage;
+	int status;
+	pid_t pid;
+
+	/* Wait for any child termination, the caller is the one
+	 * knowing which of its summoned processes it was */
+	while (pid = wait4(-1, &status, WNOHANG, &usage), pid <= 0) {
+		if (pid < 0) {
+			if (errno == ECHILD) {
+				return 0;
+			}
+
+			if (errno != EINTR) {
+				return luaL_error(L, "hex.reap: wait4: %s", strerror(errno));
+			}
+
+			continue;
+		}
+
+		/* Children are still running, nothing summoned
+		 * means no self-pipe, simply block until one terminates */
+		if (hex_sigchld_fds[0] < 0) {
+			while (pid = wait4(-1, &status, 0, &usage), pid < 0 && errno == EINTR);
+			if (pid > 0) {
+				break;
+			}
+			continue;
+		}
+
+		struct pollfd fds[] = {
+			{ .fd = hex_sigchld_fds[0], .events = POLLIN },
+			{ .fd = hex_jobserver.reader, .events = POLLIN },
+		};
+		int milliseconds = -1;
+
+		if (timeout >= 0) {
+			const double left = deadline - hex_now();
+
+			if (left <= 0) {
+				lua_pushboolean(L, 0);
+				return 1;
+			}
+
+			milliseconds = left * 1000 + 1;
+		}
+
+		if (poll(fds, wake ? 2 : 1, milliseconds) < 0) {
+			if (errno != EINTR) {
+				return luaL_error(L, "hex.reap: poll: %s", strerror(errno));
+			}
+			continue;
+		}
+
+		if (fds[0].revents & POLLIN) {
+			char buffer[64];
+			while (read(hex_sigchld_fds[0], buffer, sizeof (buffer)) > 0);
+		}
+
+		if (wake && (fds[1].revents & POLLIN)) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+	}
+
+	hex_groups_remove(pid);
+
+	lua_pushinteger(L, pid);
+	if (hex_push_status(L, "hex.summon", status) == 0) {
+		lua_pushnil(L);
+	}
+	hex_push_usage(L, &usage);
+
+	return 3;
+}
+
+#define HEX_PROCESS_METATABLE "hex.process"
+
+/* Process spawned by hex.spawn, pidfd is used to wait for it when available */
+struct hex_process {
+	pid_t pid;
+	int pidfd;
+	int status;
+	bool terminated;
+};
+
+/* Reaps the process if it terminated, returns whether it did */
+static bool
+hex_process_reap(struct hex_process *process, int options) {
+
+	if (!process->terminated) {
+		pid_t pid;
+
+		while (pid = waitpid(process->pid, &process->status, options), pid < 0 && errno == EINTR);
+
+		if (pid == 0) {
+			return false;
+		}
+
+		/* Reaped by someone else, the status is lost */
+		if (pid < 0) {
+			process->status = 0;
+		}
+
+		if (process->pidfd >= 0) {
+			close(process->pidfd);
+			process->pidfd = -1;
+		}
+
+		process->terminated = true;
+	}
+
+	return true;
+}
+
+/* Blocks until at least one of the processes terminated, and reaps it.
+ * Pidfds are polled when all processes have one, the SIGCHLD self-pipe else. */
+static int
+hex_process_waitany(struct hex_process * const *processes, size_t count) {
+	struct pollfd fds[count];
+
+	while (true) {
+		bool pidfds = true;
+
+		for (size_t i = 0; i < count; i++) {
+			if (hex_process_reap(processes[i], WNOHANG)) {
+				return 0;
+			}
+
+			fds[i].fd = processes[i]->pidfd;
+			fds[i].events = POLLIN;
+			pidfds = pidfds && fds[i].fd >= 0;
+		}
+
+		if (!pidfds) {
+			fds[0].fd = hex_sigchld_fds[0];
+			fds[0].events = POLLIN;
+			count = 1;
+		}
+
+		if (poll(fds, count, -1) < 0 && errno != EINTR) {
+			return errno;
+		}
+
+		if (!pidfds && (fds[0].revents & POLLIN)) {
+			char buffer[64];
+			while (read(hex_sigchld_fds[0], buffer, sizeof (buffer)) > 0);
+		}
+	}
+}
+
+static int
+hex_process_gc(lua_State *L) {
+	struct hex_process * const process = luaL_checkudata(L, 1, HEX_PROCESS_METATABLE);
+
+	/* Collection must never block: unwaited processes are killed, and reaped if already dead.
+	 * A process not dead yet is left a zombie, until hex exits or hex.reap reaps it */
+	if (!process->terminated) {
+#if defined(__linux__) && defined(SYS_pidfd_send_signal)
+		if (process->pidfd >= 0) {
+			syscall(SYS_pidfd_send_signal, process->pidfd, SIGKILL, NULL, 0);
+		} else {
+			kill(process->pid, SIGKILL);
+		}
+#else
+		kill(process->pid, SIGKILL);
+#endif
+
+		if (!hex_process_reap(process, WNOHANG) && process->pidfd >= 0) {
+			close(process->pidfd);
+			process->pidfd = -1;
+		}
+	}
+
+	return 0;
+}
+
+static int
+lua_hex_spawn(lua_State *L) {
+	const int top = hex_unpack_arguments(L);
+	char *argv[top + 1];
+
+	/* Fill argv */
+	for (int i = 0; i < top; i++) {
+		size_t length;
+		const char *arg = luaL_checklstring(L, i + 1, &length);
+		argv[i] = strncpy(alloca(length + 1), arg, length + 1);
+	}
+	argv[top] = NULL;
+
+	hex_print_command(L, top, argv);
+
+	struct hex_process * const process = lua_newuserdatauv(L, sizeof (*process), 0);
+	process->pid = -1;
+	process->pidfd = -1;
+	process->status = 0;
+	process->terminated = true;
+
+	if (luaL_newmetatable(L, HEX_PROCESS_METATABLE)) {
+		lua_pushcfunction(L, hex_process_gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	const int errcode = hex_spawn(&process->pid, argv, -1, -1, false);
+	if (errcode != 0) {
+		return luaL_error(L, "hex.spawn: posix_spawnp %s: %s", *argv, strerror(errcode));
+	}
+
+	process->terminated = false;
+
+#if defined(__linux__) && defined(SYS_pidfd_open)
+	process->pidfd = syscall(SYS_pidfd_open, process->pid, 0);
+#endif
+
+	/* Kernels without pidfds wake waiters up through SIGCHLD */
+	if (process->pidfd < 0) {
+		hex_sigchld_setup(L, "hex.spawn");
+	}
+
+	return 1;
+}
+
+/* Processes at indices first to last, stored in processes. Returns the index of a terminated one, 0 if none */
+static int
+hex_process_check(lua_State *L, int first, int last, struct hex_process **processes) {
+	int terminated = 0;
+
+	for (int i = first; i <= last; i++) {
+		struct hex_process * const process = luaL_checkudata(L, i, HEX_PROCESS_METATABLE);
+
+		processes[i - first] = process;
+		if (terminated == 0 && hex_process_reap(process, WNOHANG)) {
+			terminated = i;
+		}
+	}
+
+	return terminated;
+}
+
+/* Yields the still running processes to hex.concurrently if in one of its coroutines,
+ * else blocks until any of them terminates */
+static int
+hex_process_suspend(lua_State *L, const char *enchantment, struct hex_process **processes, int count, lua_KContext ctx, lua_KFunction k) {
+	struct hex_process *running[count];
+	int runningcount = 0;
+
+	for (int i = 0; i < count; i++) {
+		if (!processes[i]->terminated) {
+			running[runningcount++] = processes[i];
+		}
+	}
+
+	if (lua_isyieldable(L)) {
+		for (int i = 0; i < runningcount; i++) {
+			lua_pushlightuserdata(L, running[i]);
+		}
+		return lua_yieldk(L, runningcount, ctx, k);
+	}
+
+	const int errcode = hex_process_waitany(running, runningcount);
+	if (errcode != 0) {
+		return luaL_error(L, "%s: poll: %s", enchantment, strerror(errcode));
+	}
+
+	return k(L, LUA_OK, ctx);
+}
+
+static int
+hex_wait_continue(lua_State *L, int status, lua_KContext ctx) {
+	const int top = ctx;
+	struct hex_process *processes[top + 1];
+	bool terminated = true;
+
+	lua_settop(L, top);
+	hex_process_check(L, 1, top, processes);
+
+	for (int i = 0; i < top; i++) {
+		terminated = terminated && processes[i]->terminated;
+	}
+
+	if (!terminated) {
+		return hex_process_suspend(L, "hex.wait", processes, top, ctx, hex_wait_continue);
+	}
+
+	for (int i = 0; i < top; i++) {
+		if (hex_push_status(L, "hex.wait", processes[i]->status) != 0) {
+			hex_where(L);
+			lua_rotate(L, -2, 1);
+			lua_concat(L, 2);
+			return lua_error(L);
+		}
 	}
+
+	return 0;
 }
 
 static int
-lua_hex_cast(lua_State *L) {
-	const int top = hex_unpack_arguments(L);
-	char *argv[top + 1];
+lua_hex_wait(lua_State *L) {
+	return hex_wait_continue(L, LUA_OK, lua_gettop(L));
+}
 
-	/* Fill argv */
-	for (int i = 0; i < top; i++) {
-		size_t length;
-		const char *arg = luaL_checklstring(L, i + 1, &length);
-		argv[i] = strncpy(alloca(length + 1), arg, length + 1);
-	}
-	argv[top] = NULL;
+static int
+hex_waitany_continue(lua_State *L, int status, lua_KContext ctx) {
+	const int top = ctx;
+	struct hex_process *processes[top + 1];
 
-	hex_print_command(L, top, argv);
+	lua_settop(L, top);
+	const int terminated = hex_process_check(L, 1, top, processes);
 
-	const pid_t pid = fork();
-	switch (pid) {
-	case 0:
-		execvp(*argv, argv);
-		fprintf(stderr, "execve %s: %s\n", *argv, strerror(errno));
-		exit(-1);
-	case -1:
-		return luaL_error(L, "hex.cast: fork: %s", strerror(errno));
-	default:
-		break;
+	if (terminated == 0) {
+		return hex_process_suspend(L, "hex.waitany", processes, top, ctx, hex_waitany_continue);
 	}
 
-	hex_wait_pid(L, "hex.cast", pid);
+	lua_pushvalue(L, terminated);
 
-	return 0;
+	return 1 + hex_push_status(L, "hex.waitany", processes[terminated - 1]->status);
 }
 
 static int
-lua_hex_charm(lua_State *L) {
-	const int top = hex_unpack_arguments(L);
-	char *argv[top + 1];
+lua_hex_waitany(lua_State *L) {
 
-	/* Fill argv */
-	for (int i = 0; i < top; i++) {
-		size_t length;
-		const char *arg = luaL_checklstring(L, i + 1, &length);
-		argv[i] = strncpy(alloca(length + 1), arg, length + 1);
-	}
-	argv[top] = NULL;
+	luaL_checkudata(L, 1, HEX_PROCESS_METATABLE);
 
-	/* Until here, it was the exact same call as lua_hex_cast, but we will redirect
-	the new process STOUT_FILENO in a pipe and retrieve its value in a lua buffer */
-	int filedes[2];
+	return hex_waitany_continue(L, LUA_OK, lua_gettop(L));
+}
 
-	if (pipe(filedes) != 0) {
-		return luaL_error(L, "hex.charm: fork: %s", strerror(errno));
+static int
+lua_hex_concurrently(lua_State *L) {
+	const int top = lua_gettop(L);
+	bool finished[top];
+	int unfinished = top;
+
+	/* Each function is replaced by its coroutine */
+	for (int i = 1; i <= top; i++) {
+		luaL_checktype(L, i, LUA_TFUNCTION);
+		lua_State * const thread = lua_newthread(L);
+		lua_pushvalue(L, i);
+		lua_xmove(L, thread, 1);
+		lua_replace(L, i);
+		finished[i - 1] = false;
 	}
 
-	const pid_t pid = fork();
-	switch (pid) {
-	case 0:
-		if (dup2(filedes[1], STDOUT_FILENO) != STDOUT_FILENO) {
-			fprintf(stderr, "dup2 %s: %s\n", *argv, strerror(errno));
-			exit(-1);
+	/* Slot for the array of yielded processes */
+	lua_settop(L, top + 1);
+
+	while (unfinished != 0) {
+		/* Processes yielded by suspended coroutines, stored in a userdata to be collected on errors */
+		struct hex_process **processes = NULL;
+		int count = 0, capacity = 0;
+
+		for (int i = 1; i <= top; i++) {
+			if (!finished[i - 1]) {
+				lua_State * const thread = lua_tothread(L, i);
+				int nresults;
+
+				switch (lua_resume(thread, L, 0, &nresults)) {
+				case LUA_OK:
+					lua_pop(thread, nresults);
+					finished[i - 1] = true;
+					unfinished--;
+					break;
+				case LUA_YIELD:
+					if (count + nresults > capacity) {
+						capacity = (count + nresults) * 2;
+						struct hex_process ** const grown = lua_newuserdatauv(L, capacity * sizeof (*grown), 0);
+						if (count != 0) {
+							memcpy(grown, processes, count * sizeof (*grown));
+						}
+						processes = grown;
+						lua_replace(L, top + 1);
+					}
+					for (int j = 0; j < nresults; j++) {
+						processes[count++] = lua_touserdata(thread, j - nresults);
+					}
+					lua_pop(thread, nresults);
+					break;
+				default:
+					lua_xmove(thread, L, 1);
+					return lua_error(L);
+				}
+			}
+		}
+
+		if (unfinished != 0) {
+			if (count == 0) {
+				return luaL_error(L, "hex.concurrently: Coroutines suspended without running processes");
+			}
+
+			const int errcode = hex_process_waitany(processes, count);
+			if (errcode != 0) {
+				return luaL_error(L, "hex.concurrently: poll: %s", strerror(errcode));
+			}
 		}
-		close(filedes[0]);
-		close(filedes[1]);
-		execvp(*argv, argv);
-		fprintf(stderr, "execve %s: %s\n", *argv, strerror(errno));
-		exit(-1);
-	case -1:
-		return luaL_error(L, "hex.charm: fork: %s", strerror(errno));
-	default:
-		break;
 	}
 
-	luaL_Buffer b;
+	return 0;
+}
 
-	luaL_buffinit(L, &b);
-	close(filedes[1]);
+static void
+hex_jobserver_close(void) {
 
-	char *buffer;
-	ssize_t readval;
-	while (buffer = luaL_prepbuffer(&b), readval = read(filedes[0], buffer, LUAL_BUFFERSIZE), readval > 0) {
-		luaL_addsize(&b, readval);
+	if (hex_jobserver.reader >= 0) {
+		if (hex_jobserver.reader != hex_jobserver.fds[0]) {
+			close(hex_jobserver.reader);
+		}
+		close(hex_jobserver.fds[0]);
+		close(hex_jobserver.fds[1]);
+		hex_jobserver.fds[0] = -1;
+		hex_jobserver.fds[1] = -1;
+		hex_jobserver.reader = -1;
 	}
+}
 
-	const int errcode = errno;
+static int
+lua_hex_jobserver(lua_State *L) {
+	const lua_Integer jobs = luaL_optinteger(L, 1, 0);
 
-	close(filedes[0]);
+	hex_jobserver_close();
 
-	if (readval < 0) {
-		return luaL_error(L, "hex.charm: read: %s", strerror(errcode));
+	if (jobs <= 1) {
+		return 0;
 	}
 
-	const size_t len = luaL_bufflen(&b);
-	if (len != 0 && luaL_buffaddr(&b)[len - 1] == '\n') {
-		luaL_buffsub(&b, 1);
+	/* Pipe-style jobserver, file descriptors must be inherited through exec */
+	if (pipe(hex_jobserver.fds) != 0) {
+		return luaL_error(L, "hex.jobserver: pipe: %s", strerror(errno));
 	}
 
-	luaL_pushresult(&b);
+	/* Every job has an implicit token, only the remaining are in the pipe */
+	for (lua_Integer token = 1; token < jobs; token++) {
+		if (write(hex_jobserver.fds[1], "+", 1) != 1) {
+			const int errcode = errno;
+			hex_jobserver_close();
+			return luaL_error(L, "hex.jobserver: write: %s", strerror(errcode));
+		}
+	}
+
+#ifdef __linux__
+	/* Re-opening a pipe creates a new file description, we can be
+	 * non-blocking without changing the one shared with children */
+	char path[32];
+	snprintf(path, sizeof (path), "/proc/self/fd/%d", hex_jobserver.fds[0]);
+	hex_jobserver.reader = open(path, O_RDONLY | O_NONBLOCK | O_CLOEXEC);
+#endif
+	if (hex_jobserver.reader < 0) {
+		hex_jobserver.reader = hex_jobserver.fds[0];
+	}
 
-	hex_wait_pid(L, "hex.charm", pid);
+	/* Export the jobserver to every make compatible child */
+	const char * const makeflags = getenv("MAKEFLAGS");
+	lua_pushfstring(L, "%s%s-j%I --jobserver-auth=%d,%d", makeflags != NULL ? makeflags : "",
+		makeflags != NULL && *makeflags != '\0' ? " " : "", jobs, hex_jobserver.fds[0], hex_jobserver.fds[1]);
+	if (setenv("MAKEFLAGS", lua_tostring(L, -1), 1) != 0) {
+		const int errcode = errno;
+		hex_jobserver_close();
+		return luaL_error(L, "hex.jobserver: setenv MAKEFLAGS: %s", strerror(errcode));
+	}
 
-	return 1;
+	return 0;
 }
 
 static int
-lua_hex_invoke(lua_State *L) {
-	size_t outputlen;
-	const char *output = lua_tolstring(L, -1, &outputlen);
-	char *filename;
+lua_hex_acquire(lua_State *L) {
+	int acquired = 1;
 
-	/* We have no lua GC's guarantee that after lua_pop, output
-	 * will still be valid. So we create a local copy */
-	if (output != NULL) {
-		filename = alloca(outputlen + 1);
-		strncpy(filename, output, outputlen + 1);
-		lua_pop(L, 1);
-	} else {
-		filename = NULL;
-	}
+	if (hex_jobserver.reader >= 0) {
+		struct pollfd fd = { .fd = hex_jobserver.reader, .events = POLLIN };
+		char token;
 
-	const int top = hex_unpack_arguments(L);
-	const pid_t pid = fork();
+		/* Without a private non-blocking reader, another process may steal
+		 * the token between poll and read, blocking until one is available */
+		acquired = poll(&fd, 1, 0) == 1 && read(hex_jobserver.reader, &token, 1) == 1;
+	}
 
-	switch (pid) {
-	case 0:
-		if (filename != NULL) {
-			/* Output redirection into a file */
-			int fd = open(filename, O_CREAT | O_TRUNC | O_WRONLY, 0666);
+	lua_pushboolean(L, acquired);
 
-			if (fd < 0) {
-				fprintf(stderr, "open %s: %s\n", filename, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+	return 1;
+}
 
-			if (dup2(fd, STDOUT_FILENO) != STDOUT_FILENO) {
-				fprintf(stderr, "dup2 (stdout) %s: %s\n", filename, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
+static int
+lua_hex_release(lua_State *L) {
 
-			if (dup2(fd, STDERR_FILENO) != STDERR_FILENO) {
-				fprintf(stderr, "dup2 (stderr) %s: %s\n", filename, strerror(errno));
-				exit(EXIT_FAILURE);
+	if (hex_jobserver.fds[1] >= 0) {
+		while (write(hex_jobserver.fds[1], "+", 1) != 1) {
+			if (errno != EINTR) {
+				return luaL_error(L, "hex.release: write: %s", strerror(errno));
 			}
-
-			close(fd);
-		}
-
-		for (int i = 1; i <= top; i++) {
-			/* We guarantee the first argument to be the first one
-			executed, so each new argument is rotated on the top to be directly
-			removed after its call */
-			lua_rotate(L, 1, -1);
-			lua_call(L, 0, 0);
 		}
-		exit(EXIT_SUCCESS);
-	case -1:
-		return luaL_error(L, "hex.invoke: fork: %s", strerror(errno));
-	default:
-		break;
 	}
 
-	hex_wait_pid(L, "hex.invoke", pid);
-
 	return 0;
 }
 
@@ -430,6 +1650,196 @@ lua_hex_hinderuser(lua_State *L) {
 	return 0;
 }
 
+#define HEX_SANCTUM_METATABLE "hex.sanctum"
+
+/* Namespaces prepared once by hex.consecrate, kept alive by their nsfs file descriptors */
+struct hex_sanctum {
+	int user, mount;
+};
+
+static int
+hex_sanctum_gc(lua_State *L) {
+	struct hex_sanctum * const sanctum = luaL_checkudata(L, 1, HEX_SANCTUM_METATABLE);
+
+	if (sanctum->user >= 0) {
+		close(sanctum->user);
+		sanctum->user = -1;
+	}
+
+	if (sanctum->mount >= 0) {
+		close(sanctum->mount);
+		sanctum->mount = -1;
+	}
+
+	return 0;
+}
+
+static int
+lua_hex_consecrate(lua_State *L) {
+#ifdef __linux__
+	int status[2], hold[2];
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+	lua_settop(L, 1);
+
+	struct hex_sanctum * const sanctum = lua_newuserdatauv(L, sizeof (*sanctum), 0);
+	sanctum->user = -1;
+	sanctum->mount = -1;
+
+	if (luaL_newmetatable(L, HEX_SANCTUM_METATABLE)) {
+		lua_pushcfunction(L, hex_sanctum_gc);
+		lua_setfield(L, -2, "__gc");
+		lua_pushcfunction(L, hex_sanctum_gc);
+		lua_setfield(L, -2, "__close");
+	}
+	lua_setmetatable(L, -2);
+
+	if (pipe2(status, O_CLOEXEC) != 0) {
+		return luaL_error(L, "hex.consecrate: pipe2: %s", strerror(errno));
+	}
+
+	if (pipe2(hold, O_CLOEXEC) != 0) {
+		const int errcode = errno;
+		close(status[0]);
+		close(status[1]);
+		return luaL_error(L, "hex.consecrate: pipe2: %s", strerror(errcode));
+	}
+
+	const pid_t pid = fork();
+
+	switch (pid) {
+	case 0: {
+		char byte;
+
+		close(status[0]);
+		close(hold[1]);
+		hex_sigchld_reset();
+		hex_groups.count = 0;
+
+		/* The holder only reports the setup's error, its end of file means success */
+		lua_pushvalue(L, 1);
+		if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+			size_t length;
+			const char *message = lua_tolstring(L, -1, &length);
+
+			if (message == NULL || length == 0) {
+				message = "Unknown error";
+				length = strlen(message);
+			}
+
+			while (write(status[1], message, length) < 0 && errno == EINTR);
+			_exit(EXIT_FAILURE);
+		}
+		close(status[1]);
+
+		/* Held until hex opened our namespaces */
+		while (read(hold[0], &byte, 1) < 0 && errno == EINTR);
+		_exit(EXIT_SUCCESS);
+	}
+	case -1: {
+		const int errcode = errno;
+		close(status[0]);
+		close(status[1]);
+		close(hold[0]);
+		close(hold[1]);
+		return luaL_error(L, "hex.consecrate: fork: %s", strerror(errcode));
+	}
+	default:
+		break;
+	}
+
+	close(status[1]);
+	close(hold[0]);
+
+	luaL_Buffer b;
+	ssize_t readval;
+
+	luaL_buffinit(L, &b);
+	while (readval = read(status[0], luaL_prepbuffer(&b), LUAL_BUFFERSIZE), readval != 0) {
+		if (readval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+		luaL_addsize(&b, readval);
+	}
+	luaL_pushresult(&b);
+	close(status[0]);
+
+	char path[64];
+	int errcode = 0;
+
+	if (lua_rawlen(L, -1) == 0) {
+		snprintf(path, sizeof (path), "/proc/%d/ns/user", (int)pid);
+		sanctum->user = open(path, O_RDONLY | O_CLOEXEC);
+		if (sanctum->user >= 0) {
+			snprintf(path, sizeof (path), "/proc/%d/ns/mnt", (int)pid);
+			sanctum->mount = open(path, O_RDONLY | O_CLOEXEC);
+		}
+		errcode = sanctum->mount < 0 ? errno : 0;
+	}
+
+	/* Once opened, the namespaces live as long as their file descriptors */
+	close(hold[1]);
+	while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+
+	if (lua_rawlen(L, -1) != 0) {
+		return luaL_error(L, "hex.consecrate: %s", lua_tostring(L, -1));
+	}
+
+	if (errcode != 0) {
+		return luaL_error(L, "hex.consecrate: open %s: %s", path, strerror(errcode));
+	}
+
+	lua_pop(L, 1);
+#else
+	lua_pushnil(L);
+#endif
+
+	return 1;
+}
+
+static int
+lua_hex_enter(lua_State *L) {
+#ifdef __linux__
+	const struct hex_sanctum * const sanctum = luaL_checkudata(L, 1, HEX_SANCTUM_METATABLE);
+	const char *failed = NULL;
+
+	if (sanctum->user < 0) {
+		return luaL_error(L, "hex.enter: Sanctum was closed");
+	}
+
+	/* Joining a mount namespace moves to its root, hex's working directory is kept */
+	const int cwd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if (cwd < 0) {
+		return luaL_error(L, "hex.enter: open .: %s", strerror(errno));
+	}
+
+	if (setns(sanctum->user, CLONE_NEWUSER) != 0) {
+		failed = "setns user";
+	} else if (setns(sanctum->mount, CLONE_NEWNS) != 0) {
+		failed = "setns mnt";
+	} else if (unshare(CLONE_NEWNS) != 0) {
+		/* A copy of the mount tree, so an invocation's mounts never leak into others' */
+		failed = "unshare";
+	} else if (fchdir(cwd) != 0) {
+		failed = "fchdir";
+	}
+
+	const int errcode = errno;
+	close(cwd);
+
+	if (failed != NULL) {
+		return luaL_error(L, "hex.enter: %s: %s", failed, strerror(errcode));
+	}
+#else
+	return luaL_error(L, "hex.enter: Namespaces are not supported on this platform");
+#endif
+
+	return 0;
+}
+
 static int
 hex_preprocess(lua_State *L, int fd, FILE *output) {
 	enum preprocessor_state {
@@ -580,15 +1990,88 @@ lua_hex_dofile(lua_State *L) {
 	return lua_gettop(L); /* Forward all returned values if no error occured */
 }
 
+static int
+lua_hex_clock(lua_State *L) {
+	struct timespec now;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &now) != 0) {
+		return luaL_error(L, "hex.clock: clock_gettime: %s", strerror(errno));
+	}
+
+	lua_pushnumber(L, now.tv_sec + now.tv_nsec / 1e9);
+
+	return 1;
+}
+
+static int
+lua_hex_digest(lua_State *L) {
+	const int top = lua_gettop(L);
+	unsigned char output[DIGEST_SIZE];
+	char string[DIGEST_STRING_SIZE];
+	struct digest digest;
+
+	digest_init(&digest);
+
+	/* Lengths are digested too, so ("ab", "c") and ("a", "bc") differ */
+	for (int i = 1; i <= top; i++) {
+		size_t length;
+		const char * const data = luaL_checklstring(L, i, &length);
+
+		digest_update_u64(&digest, length);
+		digest_update(&digest, data, length);
+	}
+
+	digest_final(&digest, output);
+	digest_string(output, string);
+	lua_pushstring(L, string);
+
+	return 1;
+}
+
+static int
+lua_hex_upvalues(lua_State *L) {
+	int count = 0;
+
+	luaL_checktype(L, 1, LUA_TFUNCTION);
+
+	/* Upvalues of C functions are private to them */
+	if (lua_iscfunction(L, 1)) {
+		return 0;
+	}
+
+	while (luaL_checkstack(L, 1, "hex.upvalues: Too many upvalues"), lua_getupvalue(L, 1, count + 1) != NULL) {
+		count++;
+	}
+
+	return count;
+}
+
 static const luaL_Reg hex_funcs[] = {
-	{ "exit",        lua_hex_exit },
-	{ "cast",        lua_hex_cast },
-	{ "charm",       lua_hex_charm },
-	{ "invoke",      lua_hex_invoke },
-	{ "incantation", lua_hex_incantation },
-	{ "preprocess",  lua_hex_preprocess },
-	{ "hinderuser",  lua_hex_hinderuser },
-	{ "dofile",      lua_hex_dofile },
+	{ "exit",         lua_hex_exit },
+	{ "cast",         lua_hex_cast },
+	{ "charm",        lua_hex_charm },
+	{ "lines",        lua_hex_lines },
+	{ "invoke",       lua_hex_invoke },
+	{ "summon",       lua_hex_summon },
+	{ "captured",     lua_hex_captured },
+	{ "reap",         lua_hex_reap },
+	{ "terminate",    lua_hex_terminate },
+	{ "spawn",        lua_hex_spawn },
+	{ "wait",         lua_hex_wait },
+	{ "waitany",      lua_hex_waitany },
+	{ "concurrently", lua_hex_concurrently },
+	{ "consecrate",   lua_hex_consecrate },
+	{ "enter",        lua_hex_enter },
+	{ "jobserver",    lua_hex_jobserver },
+	{ "acquire",      lua_hex_acquire },
+	{ "release",      lua_hex_release },
+	{ "incantation",  lua_hex_incantation },
+	{ "preprocess",   lua_hex_preprocess },
+	{ "hinderuser",   lua_hex_hinderuser },
+	{ "dofile",       lua_hex_dofile },
+	{ "clock",        lua_hex_clock },
+	{ "digest",       lua_hex_digest },
+	{ "upvalues",     lua_hex_upvalues },
 	{ NULL, NULL }
 };
 
@@ -0,0 +1,404 @@
+#include "hex/lua.h"
+#include "report.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Events are written as JSON lines, each one an object with the event name,
+ * the monotonic time it was reported at, and the id of the process which reported it.
+ * Each line is written at once, so it can be followed as it's written.
+ * The upvalue is the start time of running invocations, indexed by material and ritual names */
+
+#define REPORT_JSON_STARTS lua_upvalueindex(1)
+
+static int report_json_fd = -1;
+
+static void
+report_json_begin(lua_State *L, luaL_Buffer *b, const char *event) {
+	char buffer[96];
+
+	snprintf(buffer, sizeof (buffer), "{\"event\":\"%s\",\"time\":%.6f,\"pid\":%d",
+		event, report_clock(), (int)getpid());
+
+	luaL_buffinit(L, b);
+	luaL_addstring(b, buffer);
+}
+
+static void
+report_json_addstring(luaL_Buffer *b, const char *key, const char *value) {
+	luaL_addstring(b, ",\"");
+	luaL_addstring(b, key);
+	luaL_addstring(b, "\":");
+	report_addjsonstring(b, value, strlen(value));
+}
+
+static void
+report_json_addnumber(luaL_Buffer *b, const char *key, lua_Number value) {
+	char buffer[96];
+
+	snprintf(buffer, sizeof (buffer), ",\"%s\":%.17g", key, value);
+	luaL_addstring(b, buffer);
+}
+
+/* Adds the array of strings at index of the stack, elements are strings
+ * referenced by the array, so they stay valid while the buffer can't share the stack */
+static void
+report_json_addarray(lua_State *L, luaL_Buffer *b, const char *key, int index) {
+	const lua_Integer count = luaL_len(L, index);
+
+	luaL_addstring(b, ",\"");
+	luaL_addstring(b, key);
+	luaL_addstring(b, "\":[");
+	for (lua_Integer i = 1; i <= count; i++) {
+		size_t length;
+
+		lua_geti(L, index, i);
+		const char * const element = lua_tolstring(L, -1, &length);
+		lua_pop(L, 1);
+
+		if (i != 1) {
+			luaL_addchar(b, ',');
+		}
+		report_addjsonstring(b, element != NULL ? element : "", element != NULL ? length : 0);
+	}
+	luaL_addchar(b, ']');
+}
+
+static void
+report_json_end(lua_State *L, luaL_Buffer *b) {
+	luaL_addstring(b, "}\n");
+	luaL_pushresult(b);
+	report_write(L, report_json_fd);
+}
+
+static int
+lua_report_json_plan(lua_State *L) {
+	luaL_Buffer b;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "invocations");
+	lua_getfield(L, 1, "jobs");
+	lua_getfield(L, 1, "predicted");
+	const lua_Integer invocations = lua_istable(L, -3) ? luaL_len(L, -3) : 0;
+	const lua_Integer jobs = lua_tointeger(L, -2);
+	const lua_Number predicted = lua_tonumber(L, -1);
+	lua_pop(L, 3);
+
+	report_json_begin(L, &b, "plan");
+	report_json_addnumber(&b, "invocations", invocations);
+	report_json_addnumber(&b, "jobs", jobs);
+	report_json_addnumber(&b, "predicted", predicted);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_incantation(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "incantation");
+	report_json_addstring(&b, "material", name);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_invocation(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	luaL_Buffer b;
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_pushnumber(L, report_clock());
+	lua_rawset(L, REPORT_JSON_STARTS);
+
+	report_json_begin(L, &b, "invocation");
+	report_json_addstring(&b, "material", name);
+	report_json_addstring(&b, "ritual", ritualname);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_completion(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const char * const message = luaL_optstring(L, 3, NULL);
+	lua_Number duration = -1;
+	luaL_Buffer b;
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, REPORT_JSON_STARTS) == LUA_TNUMBER) {
+		duration = report_clock() - lua_tonumber(L, -1);
+	}
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, REPORT_JSON_STARTS);
+
+	report_json_begin(L, &b, "completion");
+	report_json_addstring(&b, "material", name);
+	report_json_addstring(&b, "ritual", ritualname);
+	if (duration >= 0) {
+		report_json_addnumber(&b, "duration", duration);
+	}
+	report_json_addstring(&b, "status", message != NULL ? "failure" : "success");
+	if (message != NULL) {
+		report_json_addstring(&b, "message", message);
+	}
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_cast(lua_State *L) {
+	const char * const program = luaL_checkstring(L, 1);
+	const lua_Number elapsed = luaL_checknumber(L, 2);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "cast");
+	report_json_addstring(&b, "program", program);
+	report_json_addnumber(&b, "duration", elapsed);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_copy(lua_State *L) {
+	const char * const source = luaL_checkstring(L, 1);
+	const char * const destination = luaL_checkstring(L, 2);
+	const lua_Integer bytes = luaL_checkinteger(L, 3);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "copy");
+	report_json_addstring(&b, "source", source);
+	report_json_addstring(&b, "destination", destination);
+	report_json_addnumber(&b, "bytes", bytes);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_remove(lua_State *L) {
+	const int top = lua_gettop(L);
+	luaL_Buffer b;
+
+	for (int i = 1; i <= top; i++) {
+		luaL_checkstring(L, i);
+	}
+
+	report_json_begin(L, &b, "remove");
+	luaL_addstring(&b, ",\"paths\":[");
+	for (int i = 1; i <= top; i++) {
+		size_t length;
+		const char * const path = lua_tolstring(L, i, &length);
+
+		if (i != 1) {
+			luaL_addchar(&b, ',');
+		}
+		report_addjsonstring(&b, path, length);
+	}
+	luaL_addchar(&b, ']');
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_preprocess(lua_State *L) {
+	const char * const source = luaL_checkstring(L, 1);
+	const char * const destination = luaL_checkstring(L, 2);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "preprocess");
+	report_json_addstring(&b, "source", source);
+	report_json_addstring(&b, "destination", destination);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_divination(lua_State *L) {
+	const char * const program = luaL_checkstring(L, 1);
+	const int hit = lua_toboolean(L, 2);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "divination");
+	report_json_addstring(&b, "program", program);
+	luaL_addstring(&b, hit ? ",\"memoized\":true" : ",\"memoized\":false");
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_skip(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const char * const reason = luaL_checkstring(L, 3);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "skip");
+	report_json_addstring(&b, "material", name);
+	report_json_addstring(&b, "ritual", ritualname);
+	report_json_addstring(&b, "reason", reason);
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_accounting(lua_State *L) {
+	static const char * const fields[] = {
+		"user", "system", "maxrss", "voluntary", "involuntary", "inblock", "oublock",
+		"cpu", "memorypeak", "readbytes", "writebytes",
+	};
+	static const size_t fieldscount = sizeof (fields) / sizeof (*fields);
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	lua_Number values[fieldscount];
+	int types[fieldscount];
+	luaL_Buffer b;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	/* Numeric fields only, fetched beforehand as the buffer can't share the stack */
+	for (size_t i = 0; i < fieldscount; i++) {
+		types[i] = lua_getfield(L, 3, fields[i]);
+		values[i] = lua_tonumber(L, -1);
+		lua_pop(L, 1);
+	}
+
+	report_json_begin(L, &b, "accounting");
+	report_json_addstring(&b, "material", name);
+	report_json_addstring(&b, "ritual", ritualname);
+	for (size_t i = 0; i < fieldscount; i++) {
+		if (types[i] == LUA_TNUMBER) {
+			report_json_addnumber(&b, fields[i], values[i]);
+		}
+	}
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_failure(lua_State *L) {
+	const char * const message = luaL_checkstring(L, 1);
+	const char * const tail = luaL_optstring(L, 2, NULL);
+	luaL_Buffer b;
+
+	report_json_begin(L, &b, "failure");
+	report_json_addstring(&b, "message", message);
+	if (tail != NULL) {
+		report_json_addstring(&b, "tail", tail);
+	}
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_json_summary(lua_State *L) {
+	luaL_Buffer b;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	lua_getfield(L, 1, "elapsed");
+	lua_getfield(L, 1, "predicted");
+	const lua_Number elapsed = lua_tonumber(L, 2), predicted = lua_tonumber(L, 3);
+	lua_getfield(L, 1, "failed");
+	lua_getfield(L, 1, "skipped");
+	lua_getfield(L, 1, "cache");
+	const int cached = lua_istable(L, 6);
+	lua_Integer hits = 0, misses = 0, bytes = 0;
+	if (cached) {
+		lua_getfield(L, 6, "hits");
+		lua_getfield(L, 6, "misses");
+		lua_getfield(L, 6, "bytes");
+		hits = lua_tointeger(L, -3);
+		misses = lua_tointeger(L, -2);
+		bytes = lua_tointeger(L, -1);
+		lua_pop(L, 3);
+	}
+	lua_getfield(L, 1, "divinations");
+	const int divined = lua_istable(L, 7);
+	lua_Integer divinedhits = 0, divinedmisses = 0;
+	if (divined) {
+		lua_getfield(L, 7, "hits");
+		lua_getfield(L, 7, "misses");
+		divinedhits = lua_tointeger(L, -2);
+		divinedmisses = lua_tointeger(L, -1);
+		lua_pop(L, 2);
+	}
+
+	report_json_begin(L, &b, "summary");
+	report_json_addnumber(&b, "elapsed", elapsed);
+	report_json_addnumber(&b, "predicted", predicted);
+	if (cached) {
+		char buffer[128];
+		snprintf(buffer, sizeof (buffer), ",\"cache\":{\"hits\":%lld,\"misses\":%lld,\"bytes\":%lld}",
+			(long long)hits, (long long)misses, (long long)bytes);
+		luaL_addstring(&b, buffer);
+	}
+	if (divined) {
+		char buffer[128];
+		snprintf(buffer, sizeof (buffer), ",\"divinations\":{\"hits\":%lld,\"misses\":%lld}",
+			(long long)divinedhits, (long long)divinedmisses);
+		luaL_addstring(&b, buffer);
+	}
+	if (lua_istable(L, 4)) {
+		report_json_addarray(L, &b, "failed", 4);
+	}
+	if (lua_istable(L, 5)) {
+		report_json_addarray(L, &b, "skipped", 5);
+	}
+	report_json_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_nothing(lua_State *L) {
+	return 0;
+}
+
+static const luaL_Reg report_json_funcs[] = {
+	{ "plan",        lua_report_json_plan },
+	{ "incantation", lua_report_json_incantation },
+	{ "invocation",  lua_report_json_invocation },
+	{ "completion",  lua_report_json_completion },
+	{ "cast",        lua_report_json_cast },
+	{ "copy",        lua_report_json_copy },
+	{ "remove",      lua_report_json_remove },
+	{ "preprocess",  lua_report_json_preprocess },
+	{ "divination",  lua_report_json_divination },
+	{ "skip",        lua_report_json_skip },
+	{ "accounting",  lua_report_json_accounting },
+	{ "tick",        lua_report_nothing },
+	{ "failure",     lua_report_json_failure },
+	{ "summary",     lua_report_json_summary },
+	{ NULL, NULL }
+};
+
+int
+luaopen_report_json(lua_State *L) {
+
+	report_json_fd = report_output(L);
+
+	luaL_newlibtable(L, report_json_funcs);
+	lua_newtable(L);
+	luaL_setfuncs(L, report_json_funcs, 1);
+
+	return 1;
+}
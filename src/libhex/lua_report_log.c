@@ -1,5 +1,31 @@
 #include "hex/lua.h"
 
+#include <stdio.h>
+
+static int
+lua_report_log_plan(lua_State *L) {
+	const int top = lua_gettop(L);
+	char buffer[128];
+
+	if (top != 1) {
+		return luaL_error(L, "report-log.plan: Expected 1 argument, found %d", top);
+	}
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "invocations");
+	lua_getfield(L, 1, "jobs");
+	lua_getfield(L, 1, "predicted");
+	snprintf(buffer, sizeof (buffer), "Planned %lld invocation(s) over %lld job(s), predicted to take %.1fs",
+		lua_istable(L, 2) ? (long long)luaL_len(L, 2) : 0LL, (long long)lua_tointeger(L, 3), lua_tonumber(L, 4));
+
+	lua_getglobal(L, "log");
+	lua_getfield(L, -1, "info");
+	lua_pushstring(L, buffer);
+	lua_call(L, 1, 0);
+
+	return 0;
+}
+
 static int
 lua_report_log_incantation(lua_State *L) {
 	const int top = lua_gettop(L);
@@ -38,19 +64,14 @@ lua_report_log_invocation(lua_State *L) {
 
 static int
 lua_report_log_copy(lua_State *L) {
-	const int top = lua_gettop(L);
-
-	if (top != 2) {
-		return luaL_error(L, "report-log.copy: Expected 2 arguments, found %d", top);
-	}
+	const char * const source = luaL_checkstring(L, 1);
+	const char * const destination = luaL_checkstring(L, 2);
+	const lua_Integer bytes = luaL_checkinteger(L, 3);
 
 	lua_getglobal(L, "log");
 	lua_getfield(L, -1, "info");
-	lua_pushliteral(L, "Copying file(s) from ");
-	lua_rotate(L, 1, -2);
-	lua_pushliteral(L, " to ");
-	lua_rotate(L, -2, 1);
-	lua_call(L, 4, 0);
+	lua_pushfstring(L, "Copied file(s) from %s to %s, %I byte(s)", source, destination, bytes);
+	lua_call(L, 1, 0);
 
 	return 0;
 }
@@ -96,29 +117,277 @@ lua_report_log_preprocess(lua_State *L) {
 	return 0;
 }
 
+static int
+lua_report_log_divination(lua_State *L) {
+	const int top = lua_gettop(L);
+
+	if (top != 2) {
+		return luaL_error(L, "report-log.divination: Expected 2 arguments, found %d", top);
+	}
+
+	const int hit = lua_toboolean(L, 2);
+	lua_settop(L, 1);
+
+	lua_getglobal(L, "log");
+	lua_getfield(L, -1, "debug");
+	lua_pushliteral(L, "Divination of ");
+	lua_rotate(L, 1, -1);
+	if (hit) {
+		lua_pushliteral(L, " (memoized)");
+	} else {
+		lua_pushliteral(L, "");
+	}
+	lua_call(L, 3, 0);
+
+	return 0;
+}
+
+static int
+lua_report_log_skip(lua_State *L) {
+	const int top = lua_gettop(L);
+
+	if (top != 3) {
+		return luaL_error(L, "report-log.skip: Expected 3 arguments, found %d", top);
+	}
+
+	lua_getglobal(L, "log");
+	lua_getfield(L, -1, "info");
+	lua_pushliteral(L, "Skipping ");
+	lua_rotate(L, 1, -3);
+	lua_pushliteral(L, " ");
+	lua_rotate(L, -3, 1);
+	lua_pushliteral(L, " (");
+	lua_rotate(L, -2, 1);
+	lua_pushliteral(L, ")");
+	lua_call(L, 7, 0);
+
+	return 0;
+}
+
+static int
+lua_report_log_completion(lua_State *L) {
+	const int top = lua_gettop(L);
+
+	if (top != 2 && top != 3) {
+		return luaL_error(L, "report-log.completion: Expected 2 or 3 arguments, found %d", top);
+	}
+
+	/* Failures are already logged by report-log.failure */
+	lua_settop(L, 2);
+
+	lua_getglobal(L, "log");
+	lua_getfield(L, -1, "debug");
+	lua_pushliteral(L, "Completed ");
+	lua_rotate(L, 1, -2);
+	lua_pushliteral(L, " ");
+	lua_rotate(L, -2, 1);
+	lua_call(L, 4, 0);
+
+	return 0;
+}
+
+static int
+lua_report_log_cast(lua_State *L) {
+	const int top = lua_gettop(L);
+	char buffer[32];
+
+	if (top != 2) {
+		return luaL_error(L, "report-log.cast: Expected 2 arguments, found %d", top);
+	}
+
+	snprintf(buffer, sizeof (buffer), " took %.2fs", luaL_checknumber(L, 2));
+	lua_settop(L, 1);
+
+	lua_getglobal(L, "log");
+	lua_getfield(L, -1, "debug");
+	lua_pushliteral(L, "Cast of ");
+	lua_rotate(L, 1, -1);
+	lua_pushstring(L, buffer);
+	lua_call(L, 3, 0);
+
+	return 0;
+}
+
+static int
+lua_report_log_accounting(lua_State *L) {
+	const int top = lua_gettop(L);
+	char buffer[128];
+
+	if (top != 3) {
+		return luaL_error(L, "report-log.accounting: Expected 3 arguments, found %d", top);
+	}
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+	lua_getfield(L, 3, "user");
+	lua_getfield(L, 3, "system");
+	lua_getfield(L, 3, "maxrss");
+	snprintf(buffer, sizeof (buffer), ": %.2fs user, %.2fs system, %lld KiB maximum resident",
+		lua_tonumber(L, -3), lua_tonumber(L, -2), (long long)lua_tointeger(L, -1) / 1024);
+	lua_settop(L, 2);
+
+	lua_getglobal(L, "log");
+	lua_getfield(L, -1, "debug");
+	lua_pushliteral(L, "Accounting of ");
+	lua_rotate(L, 1, -2);
+	lua_pushliteral(L, " ");
+	lua_rotate(L, -2, 1);
+	lua_pushstring(L, buffer);
+	lua_call(L, 5, 0);
+
+	return 0;
+}
+
 static int
 lua_report_log_failure(lua_State *L) {
 	const int top = lua_gettop(L);
 
-	if (top != 1) {
-		return luaL_error(L, "report-log.failure: Expected 1 argument, found %d", top);
+	if (top != 1 && top != 2) {
+		return luaL_error(L, "report-log.failure: Expected 1 or 2 arguments, found %d", top);
 	}
 
+	/* The end of the failed invocation's output follows the message, if any */
+	if (top == 2 && !lua_isnil(L, 2)) {
+		lua_pushliteral(L, "\n");
+		lua_insert(L, 2);
+	} else {
+		lua_settop(L, 1);
+	}
+
+	const int count = lua_gettop(L);
+
 	lua_getglobal(L, "log");
 	lua_getfield(L, -1, "error");
-	lua_rotate(L, 1, -1);
-	lua_call(L, 1, 0);
+	lua_rotate(L, 1, -count);
+	lua_call(L, count, 0);
+
+	return 0;
+}
+
+/* Logs a summary's array of material names, if not empty */
+static void
+lua_report_log_summary_names(lua_State *L, const char *field, const char *level, const char *prefix) {
 
+	lua_getfield(L, 1, field);
+	if (lua_istable(L, 3) && luaL_len(L, 3) != 0) {
+		const lua_Integer count = luaL_len(L, 3);
+		luaL_Buffer b;
+
+		lua_getfield(L, 2, level);
+		luaL_buffinit(L, &b);
+		luaL_addstring(&b, prefix);
+		for (lua_Integer i = 1; i <= count; i++) {
+			if (i != 1) {
+				luaL_addstring(&b, ", ");
+			}
+			lua_geti(L, 3, i);
+			luaL_addvalue(&b);
+		}
+		luaL_pushresult(&b);
+		lua_call(L, 1, 0);
+	}
+	lua_settop(L, 2);
+}
+
+static int
+lua_report_log_summary(lua_State *L) {
+	char buffer[128];
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	lua_getglobal(L, "log");
+
+	lua_getfield(L, 1, "elapsed");
+	lua_getfield(L, 1, "predicted");
+	if (lua_isnumber(L, -2) && lua_isnumber(L, -1)) {
+		snprintf(buffer, sizeof (buffer), "Performance took %.1fs, predicted %.1fs",
+			lua_tonumber(L, -2), lua_tonumber(L, -1));
+		lua_getfield(L, 2, "notice");
+		lua_pushstring(L, buffer);
+		lua_call(L, 1, 0);
+	}
+	lua_settop(L, 2);
+
+	lua_getfield(L, 1, "cache");
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "hits");
+		lua_getfield(L, 3, "misses");
+		lua_getfield(L, 3, "bytes");
+		snprintf(buffer, sizeof (buffer), "Cache had %lld hit(s), %lld miss(es), %lld byte(s) copied",
+			(long long)lua_tointeger(L, -3), (long long)lua_tointeger(L, -2), (long long)lua_tointeger(L, -1));
+		lua_getfield(L, 2, "info");
+		lua_pushstring(L, buffer);
+		lua_call(L, 1, 0);
+	}
+	lua_settop(L, 2);
+
+	lua_getfield(L, 1, "divinations");
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "hits");
+		lua_getfield(L, 3, "misses");
+		const lua_Integer hits = lua_tointeger(L, -2), misses = lua_tointeger(L, -1);
+		if (hits + misses != 0) {
+			snprintf(buffer, sizeof (buffer), "Divinations had %lld hit(s), %lld miss(es), %.0f%% hit rate",
+				(long long)hits, (long long)misses, 100.0 * hits / (hits + misses));
+			lua_getfield(L, 2, "info");
+			lua_pushstring(L, buffer);
+			lua_call(L, 1, 0);
+		}
+	}
+	lua_settop(L, 2);
+
+	lua_report_log_summary_names(L, "failed", "error", "Failed materials: ");
+	lua_report_log_summary_names(L, "skipped", "warning", "Skipped materials: ");
+
+	/* Only the costliest few, the rest is better read through report.accounting */
+	lua_getfield(L, 1, "costs");
+	if (lua_istable(L, 3) && luaL_len(L, 3) != 0) {
+		const lua_Integer count = luaL_len(L, 3) < 5 ? luaL_len(L, 3) : 5;
+		luaL_Buffer b;
+
+		lua_getfield(L, 2, "info");
+		luaL_buffinit(L, &b);
+		luaL_addstring(&b, "Costliest materials: ");
+		for (lua_Integer i = 1; i <= count; i++) {
+			if (i != 1) {
+				luaL_addstring(&b, ", ");
+			}
+			lua_geti(L, 3, i);
+			lua_getfield(L, -1, "cpu");
+			snprintf(buffer, sizeof (buffer), " (%.1fs CPU)", lua_tonumber(L, -1));
+			lua_getfield(L, -2, "name");
+			lua_replace(L, -3);
+			lua_pop(L, 1);
+			luaL_addvalue(&b);
+			luaL_addstring(&b, buffer);
+		}
+		luaL_pushresult(&b);
+		lua_call(L, 1, 0);
+	}
+	lua_settop(L, 2);
+
+	return 0;
+}
+
+static int
+lua_report_nothing(lua_State *L) {
 	return 0;
 }
 
 static const luaL_Reg report_log_funcs[] = {
+	{ "plan",        lua_report_log_plan },
 	{ "incantation", lua_report_log_incantation },
 	{ "invocation",  lua_report_log_invocation },
+	{ "completion",  lua_report_log_completion },
+	{ "cast",        lua_report_log_cast },
 	{ "copy",        lua_report_log_copy },
 	{ "remove",      lua_report_log_remove },
 	{ "preprocess",  lua_report_log_preprocess },
+	{ "divination",  lua_report_log_divination },
+	{ "skip",        lua_report_log_skip },
+	{ "accounting",  lua_report_log_accounting },
+	{ "tick",        lua_report_nothing },
 	{ "failure",     lua_report_log_failure },
+	{ "summary",     lua_report_log_summary },
 	{ NULL, NULL }
 };
 
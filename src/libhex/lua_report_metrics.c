@@ -0,0 +1,517 @@
+#define _GNU_SOURCE
+#include "hex/lua.h"
+#include "report.h"
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+
+/* Metrics are kept until written in the text exposition format, at the end of the performance,
+ * and while it runs at most every REPORT_METRICS_INTERVAL seconds when the output is a path, on completions and ticks.
+ * Invocations are reported by the summoner, so their series are kept as Lua tables in the first upvalue,
+ * indexed by material and ritual names. The second upvalue is the start time of running invocations,
+ * the third one the count of skipped invocations by reason. Filesystem operations and casts are also
+ * reported by summoned processes, their counters live in a mapping shared with forked processes */
+
+#define REPORT_METRICS_SERIES lua_upvalueindex(1)
+#define REPORT_METRICS_STARTS lua_upvalueindex(2)
+#define REPORT_METRICS_SKIPS  lua_upvalueindex(3)
+
+#define REPORT_METRICS_INTERVAL 60.0
+
+struct report_metrics_shared {
+	atomic_ullong copies, copiedbytes;
+	atomic_ullong removes, preprocesses;
+	atomic_ullong casts, castmicroseconds;
+	atomic_ullong divinations, memoized;
+};
+
+struct report_metrics_summary {
+	bool summarized, cached;
+	lua_Number elapsed, predicted;
+	lua_Integer failed, skipped;
+	lua_Integer hits, misses, bytes;
+};
+
+static const lua_Number report_metrics_buckets[] = {
+	0.1, 0.5, 1, 5, 10, 30, 60, 300, 900, 3600,
+};
+
+static const size_t report_metrics_bucketscount = sizeof (report_metrics_buckets) / sizeof (*report_metrics_buckets);
+
+static struct report_metrics_shared report_metrics_unshared, *report_metrics_shared = &report_metrics_unshared;
+static struct report_metrics_summary report_metrics_summary;
+static int report_metrics_fd = -1;
+static const char *report_metrics_path;
+static double report_metrics_written;
+
+/* Pushes value escaped as a label value */
+static const char *
+report_metrics_pushlabel(lua_State *L, const char *value) {
+
+	luaL_gsub(L, value, "\\", "\\\\");
+	luaL_gsub(L, lua_tostring(L, -1), "\"", "\\\"");
+	lua_replace(L, -2);
+	luaL_gsub(L, lua_tostring(L, -1), "\n", "\\n");
+	lua_replace(L, -2);
+
+	return lua_tostring(L, -1);
+}
+
+/* Pushes the series of an invocation, creating it if needed */
+static void
+report_metrics_pushseries(lua_State *L, const char *name, const char *ritualname) {
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	if (lua_rawget(L, REPORT_METRICS_SERIES) == LUA_TTABLE) {
+		return;
+	}
+	lua_pop(L, 1);
+
+	lua_createtable(L, report_metrics_bucketscount, 6);
+
+	report_metrics_pushlabel(L, name);
+	report_metrics_pushlabel(L, ritualname);
+	lua_pushfstring(L, "material=\"%s\",ritual=\"%s\"", lua_tostring(L, -2), lua_tostring(L, -1));
+	lua_setfield(L, -4, "labels");
+	lua_pop(L, 2);
+
+	for (size_t i = 1; i <= report_metrics_bucketscount; i++) {
+		lua_pushinteger(L, 0);
+		lua_rawseti(L, -2, i);
+	}
+	lua_pushinteger(L, 0);
+	lua_setfield(L, -2, "success");
+	lua_pushinteger(L, 0);
+	lua_setfield(L, -2, "failure");
+	lua_pushinteger(L, 0);
+	lua_setfield(L, -2, "count");
+	lua_pushnumber(L, 0);
+	lua_setfield(L, -2, "sum");
+	lua_pushnumber(L, 0);
+	lua_setfield(L, -2, "cpu");
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, REPORT_METRICS_SERIES);
+}
+
+/* Adds amount to the numeric field of the table on top of the stack */
+static void
+report_metrics_add(lua_State *L, const char *field, lua_Number amount) {
+
+	lua_getfield(L, -1, field);
+	lua_pushnumber(L, lua_tonumber(L, -1) + amount);
+	lua_setfield(L, -3, field);
+	lua_pop(L, 1);
+}
+
+/* Appends a formatted line to the lines table at index */
+static void
+report_metrics_line(lua_State *L, int index, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	lua_pushvfstring(L, fmt, ap);
+	va_end(ap);
+
+	lua_rawseti(L, index, luaL_len(L, index) + 1);
+}
+
+static void
+report_metrics_family(lua_State *L, int index, const char *name, const char *type, const char *help) {
+	report_metrics_line(L, index, "# HELP %s %s\n", name, help);
+	report_metrics_line(L, index, "# TYPE %s %s\n", name, type);
+}
+
+static void
+report_metrics_sample(lua_State *L, int index, const char *type, const char *name, const char *help, lua_Number value) {
+	report_metrics_family(L, index, name, type, help);
+	report_metrics_line(L, index, "%s %f\n", name, value);
+}
+
+/* Pushes the metrics, the series table is walked once for each family
+ * as samples of a family must be grouped together */
+static void
+report_metrics_render(lua_State *L) {
+	const struct report_metrics_shared * const shared = report_metrics_shared;
+	const struct report_metrics_summary * const summary = &report_metrics_summary;
+	const int lines = lua_gettop(L) + 1;
+	luaL_Buffer b;
+
+	lua_newtable(L);
+
+	report_metrics_family(L, lines, "hex_invocation_duration_seconds", "histogram",
+		"Duration of invocations, from their start to their completion.");
+	lua_pushnil(L);
+	while (lua_next(L, REPORT_METRICS_SERIES) != 0) {
+		lua_getfield(L, -1, "labels");
+		const char * const labels = lua_tostring(L, -1);
+
+		for (size_t i = 0; i < report_metrics_bucketscount; i++) {
+			lua_rawgeti(L, -2, i + 1);
+			report_metrics_line(L, lines, "hex_invocation_duration_seconds_bucket{%s,le=\"%f\"} %I\n",
+				labels, report_metrics_buckets[i], lua_tointeger(L, -1));
+			lua_pop(L, 1);
+		}
+		lua_getfield(L, -2, "count");
+		lua_getfield(L, -3, "sum");
+		report_metrics_line(L, lines, "hex_invocation_duration_seconds_bucket{%s,le=\"+Inf\"} %I\n",
+			labels, lua_tointeger(L, -2));
+		report_metrics_line(L, lines, "hex_invocation_duration_seconds_sum{%s} %f\n",
+			labels, lua_tonumber(L, -1));
+		report_metrics_line(L, lines, "hex_invocation_duration_seconds_count{%s} %I\n",
+			labels, lua_tointeger(L, -2));
+		lua_pop(L, 4);
+	}
+
+	report_metrics_family(L, lines, "hex_invocations_total", "counter",
+		"Completed invocations, by status.");
+	lua_pushnil(L);
+	while (lua_next(L, REPORT_METRICS_SERIES) != 0) {
+		lua_getfield(L, -1, "labels");
+		lua_getfield(L, -2, "success");
+		lua_getfield(L, -3, "failure");
+		report_metrics_line(L, lines, "hex_invocations_total{%s,status=\"success\"} %I\n",
+			lua_tostring(L, -3), lua_tointeger(L, -2));
+		report_metrics_line(L, lines, "hex_invocations_total{%s,status=\"failure\"} %I\n",
+			lua_tostring(L, -3), lua_tointeger(L, -1));
+		lua_pop(L, 4);
+	}
+
+	report_metrics_family(L, lines, "hex_invocation_cpu_seconds_total", "counter",
+		"CPU time used by invocations, as accounted.");
+	lua_pushnil(L);
+	while (lua_next(L, REPORT_METRICS_SERIES) != 0) {
+		lua_getfield(L, -1, "labels");
+		lua_getfield(L, -2, "cpu");
+		report_metrics_line(L, lines, "hex_invocation_cpu_seconds_total{%s} %f\n",
+			lua_tostring(L, -2), lua_tonumber(L, -1));
+		lua_pop(L, 3);
+	}
+
+	report_metrics_family(L, lines, "hex_skips_total", "counter",
+		"Skipped invocations, by reason.");
+	lua_pushnil(L);
+	while (lua_next(L, REPORT_METRICS_SKIPS) != 0) {
+		/* Read before the label is pushed, as arguments are evaluated in any order */
+		const lua_Integer count = lua_tointeger(L, -1);
+
+		report_metrics_line(L, lines, "hex_skips_total{reason=\"%s\"} %I\n",
+			report_metrics_pushlabel(L, lua_tostring(L, -2)), count);
+		lua_pop(L, 2);
+	}
+
+	report_metrics_sample(L, lines, "counter", "hex_copies_total", "Copies done by fs.copy.",
+		atomic_load(&shared->copies));
+	report_metrics_sample(L, lines, "counter", "hex_copied_bytes_total", "Bytes of regular files copied by fs.copy.",
+		atomic_load(&shared->copiedbytes));
+	report_metrics_sample(L, lines, "counter", "hex_removes_total", "Removals done by fs.remove.",
+		atomic_load(&shared->removes));
+	report_metrics_sample(L, lines, "counter", "hex_preprocesses_total", "Files preprocessed by fs.preprocess.",
+		atomic_load(&shared->preprocesses));
+	report_metrics_sample(L, lines, "counter", "hex_casts_total", "Programs executed by casts.",
+		atomic_load(&shared->casts));
+	report_metrics_sample(L, lines, "counter", "hex_cast_seconds_total", "Time spent in casts.",
+		atomic_load(&shared->castmicroseconds) / 1e6);
+	report_metrics_sample(L, lines, "counter", "hex_divinations_total", "Divinations done by hex.divine.",
+		atomic_load(&shared->divinations));
+	report_metrics_sample(L, lines, "counter", "hex_divinations_memoized_total", "Divinations answered from memoization.",
+		atomic_load(&shared->memoized));
+
+	if (summary->summarized) {
+		report_metrics_sample(L, lines, "gauge", "hex_performance_elapsed_seconds",
+			"Duration of the performance.", summary->elapsed);
+		report_metrics_sample(L, lines, "gauge", "hex_performance_predicted_seconds",
+			"Duration the performance was predicted to last.", summary->predicted);
+		report_metrics_sample(L, lines, "gauge", "hex_performance_failed_materials",
+			"Materials which failed during the performance.", summary->failed);
+		report_metrics_sample(L, lines, "gauge", "hex_performance_skipped_materials",
+			"Materials skipped during the performance because of a failure.", summary->skipped);
+		if (summary->cached) {
+			report_metrics_sample(L, lines, "counter", "hex_cache_hits_total", "Materials restored from the cache.", summary->hits);
+			report_metrics_sample(L, lines, "counter", "hex_cache_misses_total", "Materials stored into the cache.", summary->misses);
+			report_metrics_sample(L, lines, "counter", "hex_cache_bytes_total", "Bytes copied from and into the cache.", summary->bytes);
+		}
+	}
+
+	report_metrics_sample(L, lines, "gauge", "hex_report_timestamp_seconds",
+		"Time the metrics were written at, since the Epoch.", time(NULL));
+	report_metrics_line(L, lines, "# EOF\n");
+
+	const lua_Integer count = luaL_len(L, lines);
+	luaL_buffinit(L, &b);
+	for (lua_Integer i = 1; i <= count; i++) {
+		lua_rawgeti(L, lines, i);
+		luaL_addvalue(&b);
+	}
+	luaL_pushresult(&b);
+	lua_remove(L, lines);
+}
+
+/* Writes the metrics, replacing the output path atomically so collectors never read a partial file */
+static void
+report_metrics_write(lua_State *L) {
+
+	report_metrics_render(L);
+	report_metrics_written = report_clock();
+
+	if (report_metrics_path == NULL) {
+		report_write(L, report_metrics_fd);
+		return;
+	}
+
+	const size_t pathlen = strlen(report_metrics_path);
+	char temporary[pathlen + sizeof (".tmp")];
+
+	memcpy(stpcpy(temporary, report_metrics_path), ".tmp", sizeof (".tmp"));
+	const int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0) {
+		lua_pop(L, 1);
+		return;
+	}
+
+	report_write(L, fd);
+
+	if (close(fd) != 0 || rename(temporary, report_metrics_path) != 0) {
+		unlink(temporary);
+	}
+}
+
+static int
+lua_report_metrics_invocation(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_pushnumber(L, report_clock());
+	lua_rawset(L, REPORT_METRICS_STARTS);
+
+	return 0;
+}
+
+static int
+lua_report_metrics_completion(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const bool failed = !lua_isnoneornil(L, 3);
+	const double now = report_clock();
+
+	lua_settop(L, 3);
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_pushvalue(L, -1);
+	const bool started = lua_rawget(L, REPORT_METRICS_STARTS) == LUA_TNUMBER;
+	const lua_Number duration = now - lua_tonumber(L, -1);
+	lua_pop(L, 1);
+	lua_pushnil(L);
+	lua_rawset(L, REPORT_METRICS_STARTS);
+
+	report_metrics_pushseries(L, name, ritualname);
+	report_metrics_add(L, failed ? "failure" : "success", 1);
+	if (started) {
+		report_metrics_add(L, "count", 1);
+		report_metrics_add(L, "sum", duration);
+		for (size_t i = 0; i < report_metrics_bucketscount; i++) {
+			if (duration <= report_metrics_buckets[i]) {
+				lua_rawgeti(L, -1, i + 1);
+				lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+				lua_rawseti(L, -3, i + 1);
+				lua_pop(L, 1);
+			}
+		}
+	}
+	lua_pop(L, 1);
+
+	if (report_metrics_path != NULL && now - report_metrics_written >= REPORT_METRICS_INTERVAL) {
+		report_metrics_write(L);
+	}
+
+	return 0;
+}
+
+static int
+lua_report_metrics_cast(lua_State *L) {
+	const lua_Number elapsed = luaL_checknumber(L, 2);
+
+	atomic_fetch_add(&report_metrics_shared->casts, 1);
+	atomic_fetch_add(&report_metrics_shared->castmicroseconds, elapsed * 1e6);
+
+	return 0;
+}
+
+static int
+lua_report_metrics_copy(lua_State *L) {
+	const lua_Integer bytes = luaL_checkinteger(L, 3);
+
+	atomic_fetch_add(&report_metrics_shared->copies, 1);
+	atomic_fetch_add(&report_metrics_shared->copiedbytes, bytes);
+
+	return 0;
+}
+
+static int
+lua_report_metrics_remove(lua_State *L) {
+
+	atomic_fetch_add(&report_metrics_shared->removes, lua_gettop(L));
+
+	return 0;
+}
+
+static int
+lua_report_metrics_preprocess(lua_State *L) {
+
+	atomic_fetch_add(&report_metrics_shared->preprocesses, 1);
+
+	return 0;
+}
+
+static int
+lua_report_metrics_divination(lua_State *L) {
+
+	atomic_fetch_add(&report_metrics_shared->divinations, 1);
+	if (lua_toboolean(L, 2)) {
+		atomic_fetch_add(&report_metrics_shared->memoized, 1);
+	}
+
+	return 0;
+}
+
+static int
+lua_report_metrics_skip(lua_State *L) {
+	const char * const reason = luaL_checkstring(L, 3);
+
+	lua_pushstring(L, reason);
+	lua_pushvalue(L, -1);
+	lua_rawget(L, REPORT_METRICS_SKIPS);
+	lua_pushinteger(L, lua_tointeger(L, -1) + 1);
+	lua_replace(L, -2);
+	lua_rawset(L, REPORT_METRICS_SKIPS);
+
+	return 0;
+}
+
+static int
+lua_report_metrics_accounting(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	lua_Number cpu;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	/* Prefer the cgroup's accounting, which includes orphaned descendants */
+	if (lua_getfield(L, 3, "cpu") == LUA_TNUMBER) {
+		cpu = lua_tonumber(L, -1);
+	} else {
+		lua_getfield(L, 3, "user");
+		lua_getfield(L, 3, "system");
+		cpu = lua_tonumber(L, -2) + lua_tonumber(L, -1);
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+
+	report_metrics_pushseries(L, name, ritualname);
+	report_metrics_add(L, "cpu", cpu);
+	lua_pop(L, 1);
+
+	return 0;
+}
+
+static int
+lua_report_metrics_tick(lua_State *L) {
+
+	if (report_metrics_path != NULL && report_clock() - report_metrics_written >= REPORT_METRICS_INTERVAL) {
+		report_metrics_write(L);
+	}
+
+	return 0;
+}
+
+static int
+lua_report_metrics_summary(lua_State *L) {
+	struct report_metrics_summary * const summary = &report_metrics_summary;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_settop(L, 1);
+
+	summary->summarized = true;
+
+	lua_getfield(L, 1, "elapsed");
+	lua_getfield(L, 1, "predicted");
+	summary->elapsed = lua_tonumber(L, 2);
+	summary->predicted = lua_tonumber(L, 3);
+	lua_settop(L, 1);
+
+	lua_getfield(L, 1, "failed");
+	lua_getfield(L, 1, "skipped");
+	summary->failed = lua_istable(L, 2) ? luaL_len(L, 2) : 0;
+	summary->skipped = lua_istable(L, 3) ? luaL_len(L, 3) : 0;
+	lua_settop(L, 1);
+
+	summary->cached = lua_getfield(L, 1, "cache") == LUA_TTABLE;
+	if (summary->cached) {
+		lua_getfield(L, 2, "hits");
+		lua_getfield(L, 2, "misses");
+		lua_getfield(L, 2, "bytes");
+		summary->hits = lua_tointeger(L, 3);
+		summary->misses = lua_tointeger(L, 4);
+		summary->bytes = lua_tointeger(L, 5);
+	}
+	lua_settop(L, 1);
+
+	report_metrics_write(L);
+
+	return 0;
+}
+
+static int
+lua_report_nothing(lua_State *L) {
+	return 0;
+}
+
+static const luaL_Reg report_metrics_funcs[] = {
+	{ "plan",        lua_report_nothing },
+	{ "incantation", lua_report_nothing },
+	{ "invocation",  lua_report_metrics_invocation },
+	{ "completion",  lua_report_metrics_completion },
+	{ "cast",        lua_report_metrics_cast },
+	{ "copy",        lua_report_metrics_copy },
+	{ "remove",      lua_report_metrics_remove },
+	{ "preprocess",  lua_report_metrics_preprocess },
+	{ "divination",  lua_report_metrics_divination },
+	{ "skip",        lua_report_metrics_skip },
+	{ "accounting",  lua_report_metrics_accounting },
+	{ "tick",        lua_report_metrics_tick },
+	{ "failure",     lua_report_nothing },
+	{ "summary",     lua_report_metrics_summary },
+	{ NULL, NULL }
+};
+
+int
+luaopen_report_metrics(lua_State *L) {
+	struct report_metrics_shared * const shared = mmap(NULL, sizeof (*shared),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+	/* Without a shared mapping, only the summoner's own operations are counted */
+	if (shared != MAP_FAILED) {
+		report_metrics_shared = shared;
+	}
+
+	report_metrics_fd = report_output(L);
+	report_metrics_path = report_outputpath(L);
+	report_metrics_written = report_clock();
+
+	luaL_newlibtable(L, report_metrics_funcs);
+	lua_newtable(L);
+	lua_newtable(L);
+	lua_newtable(L);
+	luaL_setfuncs(L, report_metrics_funcs, 3);
+
+	return 1;
+}
@@ -6,12 +6,20 @@ lua_report_nothing(lua_State *L) {
 }
 
 static const luaL_Reg report_none_funcs[] = {
+	{ "plan",        lua_report_nothing },
 	{ "incantation", lua_report_nothing },
 	{ "invocation",  lua_report_nothing },
+	{ "completion",  lua_report_nothing },
+	{ "cast",        lua_report_nothing },
 	{ "copy",        lua_report_nothing },
 	{ "remove",      lua_report_nothing },
 	{ "preprocess",  lua_report_nothing },
+	{ "divination",  lua_report_nothing },
+	{ "skip",        lua_report_nothing },
+	{ "accounting",  lua_report_nothing },
+	{ "tick",        lua_report_nothing },
 	{ "failure",     lua_report_nothing },
+	{ "summary",     lua_report_nothing },
 	{ NULL, NULL }
 };
 
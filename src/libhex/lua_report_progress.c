@@ -0,0 +1,435 @@
+#include "hex/lua.h"
+#include "report.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+
+/* Progress is drawn as a status area at the bottom of the standard error, redrawn in place
+ * on each event reported by hex itself, but at most every REPORT_PROGRESS_PERIOD seconds.
+ * When the standard error is not a terminal, a line is printed per completed invocation instead.
+ * The first upvalue is the estimated duration of planned invocations, indexed by material and ritual names,
+ * the second one the array of running invocations, in the order they were started */
+
+#define REPORT_PROGRESS_ESTIMATES lua_upvalueindex(1)
+#define REPORT_PROGRESS_RUNNING   lua_upvalueindex(2)
+
+#define REPORT_PROGRESS_PERIOD 0.1
+#define REPORT_PROGRESS_ROWS   8
+
+struct report_progress_screen {
+	char data[8192];
+	size_t length;
+	size_t columns, lines;
+};
+
+static pid_t report_progress_pid = -1;
+static bool report_progress_tty;
+static int report_progress_drawn;
+static double report_progress_drawnat;
+static double report_progress_begin;
+static lua_Integer report_progress_total = -1, report_progress_done, report_progress_failed, report_progress_jobs = 1;
+/* Estimated duration of invocations neither started nor skipped */
+static lua_Number report_progress_pending;
+
+static void
+report_progress_duration(char *buffer, size_t size, double seconds) {
+	const long long rounded = seconds;
+
+	if (rounded >= 3600) {
+		snprintf(buffer, size, "%lldh%02lldm", rounded / 3600, rounded % 3600 / 60);
+	} else if (rounded >= 60) {
+		snprintf(buffer, size, "%lldm%02llds", rounded / 60, rounded % 60);
+	} else {
+		snprintf(buffer, size, "%.1fs", seconds);
+	}
+}
+
+static void
+report_progress_append(struct report_progress_screen *screen, const char *string) {
+
+	while (*string != '\0' && screen->length < sizeof (screen->data)) {
+		screen->data[screen->length++] = *string++;
+	}
+}
+
+/* Appends a line, truncated to the width of the terminal so it never wraps.
+ * UTF-8 continuation bytes don't take a column */
+static void
+report_progress_line(struct report_progress_screen *screen, const char *line) {
+	size_t columns = 0;
+
+	if (screen->lines++ != 0) {
+		report_progress_append(screen, "\n");
+	}
+
+	while (*line != '\0' && screen->length < sizeof (screen->data)) {
+		const bool continuation = (*line & 0xC0) == 0x80;
+
+		if (!continuation && columns == screen->columns) {
+			break;
+		}
+
+		screen->data[screen->length++] = *line++;
+		columns += !continuation;
+	}
+}
+
+/* Appends the sequence moving back to the beginning of the status area and clearing it */
+static void
+report_progress_erase(struct report_progress_screen *screen) {
+	char sequence[32];
+
+	if (report_progress_drawn > 1) {
+		snprintf(sequence, sizeof (sequence), "\r\033[%dA\033[J", report_progress_drawn - 1);
+	} else {
+		snprintf(sequence, sizeof (sequence), "\r\033[J");
+	}
+
+	report_progress_append(screen, sequence);
+	report_progress_drawn = 0;
+}
+
+static void
+report_progress_flush(lua_State *L, struct report_progress_screen *screen) {
+	lua_pushlstring(L, screen->data, screen->length);
+	report_write(L, STDERR_FILENO);
+}
+
+static void
+report_progress_init(struct report_progress_screen *screen) {
+	struct winsize size;
+
+	screen->length = 0;
+	screen->lines = 0;
+	screen->columns = ioctl(STDERR_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col != 0 ? size.ws_col - 1 : 79;
+}
+
+static void
+report_progress_draw(lua_State *L, bool force) {
+	const double now = report_clock();
+	struct report_progress_screen screen;
+	char line[512], elapsed[32], eta[32];
+	lua_Number runningleft = 0, longest = 0;
+
+	if (!report_progress_tty || getpid() != report_progress_pid
+		|| (!force && now - report_progress_drawnat < REPORT_PROGRESS_PERIOD)) {
+		return;
+	}
+
+	/* Erasure and drawing are written at once, so the terminal never shows an empty area */
+	report_progress_init(&screen);
+	report_progress_erase(&screen);
+
+	const lua_Integer runningcount = luaL_len(L, REPORT_PROGRESS_RUNNING);
+	for (lua_Integer i = 1; i <= runningcount; i++) {
+		lua_rawgeti(L, REPORT_PROGRESS_RUNNING, i);
+		lua_getfield(L, -1, "start");
+		lua_getfield(L, -2, "estimate");
+		lua_Number left = lua_tonumber(L, -1) - (now - lua_tonumber(L, -2));
+		lua_pop(L, 3);
+
+		if (left < 0) {
+			left = 0;
+		}
+		if (left > longest) {
+			longest = left;
+		}
+		runningleft += left;
+	}
+
+	/* Pending invocations are spread over the jobs, but can't end before the longest running one */
+	lua_Number remaining = (report_progress_pending + runningleft) / report_progress_jobs;
+	if (remaining < longest) {
+		remaining = longest;
+	}
+
+	report_progress_duration(elapsed, sizeof (elapsed), now - report_progress_begin);
+	report_progress_duration(eta, sizeof (eta), remaining);
+	if (report_progress_total > 0) {
+		snprintf(line, sizeof (line), "[%lld/%lld] %3d%%, %lld running, %lld failed, elapsed %s, ETA %s",
+			(long long)report_progress_done, (long long)report_progress_total,
+			(int)(report_progress_done * 100 / report_progress_total), (long long)runningcount,
+			(long long)report_progress_failed, elapsed, eta);
+	} else {
+		snprintf(line, sizeof (line), "[%lld] %lld running, %lld failed, elapsed %s",
+			(long long)report_progress_done, (long long)runningcount, (long long)report_progress_failed, elapsed);
+	}
+	report_progress_line(&screen, line);
+
+	for (lua_Integer i = 1; i <= runningcount && i <= REPORT_PROGRESS_ROWS; i++) {
+		lua_rawgeti(L, REPORT_PROGRESS_RUNNING, i);
+		lua_getfield(L, -1, "label");
+		lua_getfield(L, -2, "start");
+		report_progress_duration(elapsed, sizeof (elapsed), now - lua_tonumber(L, -1));
+		snprintf(line, sizeof (line), "  %s %s", lua_tostring(L, -2), elapsed);
+		lua_pop(L, 3);
+
+		report_progress_line(&screen, line);
+	}
+
+	if (runningcount > REPORT_PROGRESS_ROWS) {
+		snprintf(line, sizeof (line), "  and %lld more", (long long)(runningcount - REPORT_PROGRESS_ROWS));
+		report_progress_line(&screen, line);
+	}
+
+	report_progress_flush(L, &screen);
+
+	report_progress_drawn = screen.lines;
+	report_progress_drawnat = now;
+}
+
+/* Prints a message above the status area, which is redrawn below it if asked to */
+static void
+report_progress_print(lua_State *L, const char *message, bool redraw) {
+	struct report_progress_screen screen;
+
+	if (getpid() != report_progress_pid) {
+		return;
+	}
+
+	report_progress_init(&screen);
+	if (report_progress_tty && report_progress_drawn != 0) {
+		report_progress_erase(&screen);
+	}
+	report_progress_append(&screen, message);
+	report_progress_append(&screen, "\n");
+	report_progress_flush(L, &screen);
+
+	if (redraw) {
+		report_progress_draw(L, true);
+	}
+}
+
+static lua_Number
+report_progress_estimate(lua_State *L, const char *name, const char *ritualname) {
+	lua_Number estimate;
+
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_rawget(L, REPORT_PROGRESS_ESTIMATES);
+	estimate = lua_tonumber(L, -1);
+	lua_pop(L, 1);
+
+	return estimate;
+}
+
+static int
+lua_report_progress_plan(lua_State *L) {
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+
+	lua_getfield(L, 1, "jobs");
+	report_progress_jobs = lua_tointeger(L, -1) > 0 ? lua_tointeger(L, -1) : 1;
+	lua_pop(L, 1);
+
+	report_progress_pending = 0;
+	report_progress_total = 0;
+	report_progress_begin = report_clock();
+
+	if (lua_getfield(L, 1, "invocations") == LUA_TTABLE) {
+		const lua_Integer count = luaL_len(L, -1);
+
+		for (lua_Integer i = 1; i <= count; i++) {
+			lua_rawgeti(L, -1, i);
+			lua_getfield(L, -1, "name");
+			lua_getfield(L, -2, "ritualname");
+			lua_getfield(L, -3, "duration");
+			const lua_Number duration = lua_tonumber(L, -1);
+			lua_pushfstring(L, "%s %s", lua_tostring(L, -3), lua_tostring(L, -2));
+			lua_pushnumber(L, duration);
+			lua_rawset(L, REPORT_PROGRESS_ESTIMATES);
+			lua_pop(L, 4);
+
+			report_progress_pending += duration;
+		}
+
+		report_progress_total = count;
+	}
+	lua_pop(L, 1);
+
+	report_progress_draw(L, true);
+
+	return 0;
+}
+
+static int
+lua_report_progress_invocation(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const lua_Number estimate = report_progress_estimate(L, name, ritualname);
+
+	report_progress_pending -= estimate;
+
+	lua_createtable(L, 0, 3);
+	lua_pushfstring(L, "%s %s", name, ritualname);
+	lua_setfield(L, -2, "label");
+	lua_pushnumber(L, report_clock());
+	lua_setfield(L, -2, "start");
+	lua_pushnumber(L, estimate);
+	lua_setfield(L, -2, "estimate");
+	lua_rawseti(L, REPORT_PROGRESS_RUNNING, luaL_len(L, REPORT_PROGRESS_RUNNING) + 1);
+
+	report_progress_draw(L, false);
+
+	return 0;
+}
+
+static int
+lua_report_progress_completion(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const char * const message = luaL_optstring(L, 3, NULL);
+	const lua_Integer count = luaL_len(L, REPORT_PROGRESS_RUNNING);
+	lua_Number start = report_clock();
+
+	lua_settop(L, 3);
+	lua_pushfstring(L, "%s %s", name, ritualname);
+
+	/* Removed by shifting the following ones, to keep them in the order they were started */
+	for (lua_Integer i = 1; i <= count; i++) {
+		lua_rawgeti(L, REPORT_PROGRESS_RUNNING, i);
+		lua_getfield(L, -1, "label");
+
+		if (lua_rawequal(L, -1, 4)) {
+			lua_getfield(L, -2, "start");
+			start = lua_tonumber(L, -1);
+			lua_pop(L, 3);
+
+			for (lua_Integer j = i; j < count; j++) {
+				lua_rawgeti(L, REPORT_PROGRESS_RUNNING, j + 1);
+				lua_rawseti(L, REPORT_PROGRESS_RUNNING, j);
+			}
+			lua_pushnil(L);
+			lua_rawseti(L, REPORT_PROGRESS_RUNNING, count);
+			break;
+		}
+
+		lua_pop(L, 2);
+	}
+
+	report_progress_done++;
+	if (message != NULL) {
+		report_progress_failed++;
+	}
+
+	if (!report_progress_tty && getpid() == report_progress_pid) {
+		char line[64], elapsed[32];
+
+		report_progress_duration(elapsed, sizeof (elapsed), report_clock() - start);
+		if (report_progress_total > 0) {
+			snprintf(line, sizeof (line), "[%lld/%lld] ", (long long)report_progress_done, (long long)report_progress_total);
+		} else {
+			snprintf(line, sizeof (line), "[%lld] ", (long long)report_progress_done);
+		}
+
+		lua_pushstring(L, line);
+		lua_pushvalue(L, 4);
+		if (message != NULL) {
+			lua_pushfstring(L, " failed after %s: %s\n", elapsed, message);
+		} else {
+			lua_pushfstring(L, " completed in %s\n", elapsed);
+		}
+		lua_concat(L, 3);
+		report_write(L, STDERR_FILENO);
+	}
+
+	report_progress_draw(L, false);
+
+	return 0;
+}
+
+static int
+lua_report_progress_skip(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+
+	report_progress_pending -= report_progress_estimate(L, name, ritualname);
+	report_progress_done++;
+
+	report_progress_draw(L, false);
+
+	return 0;
+}
+
+/* Running invocations' elapsed times and the ETA keep moving between events */
+static int
+lua_report_progress_tick(lua_State *L) {
+
+	report_progress_draw(L, false);
+
+	return 0;
+}
+
+static int
+lua_report_progress_failure(lua_State *L) {
+	const char * const message = luaL_checkstring(L, 1);
+	const char * const tail = luaL_optstring(L, 2, NULL);
+
+	if (tail != NULL) {
+		lua_pushfstring(L, "%s\n%s", message, tail);
+		report_progress_print(L, lua_tostring(L, -1), true);
+	} else {
+		report_progress_print(L, message, true);
+	}
+
+	return 0;
+}
+
+static int
+lua_report_progress_summary(lua_State *L) {
+	char line[256], elapsed[32], predicted[32];
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "elapsed");
+	lua_getfield(L, 1, "predicted");
+	report_progress_duration(elapsed, sizeof (elapsed), lua_tonumber(L, -2));
+	report_progress_duration(predicted, sizeof (predicted), lua_tonumber(L, -1));
+	lua_pop(L, 2);
+
+	snprintf(line, sizeof (line), "Performed %lld invocation(s), %lld failed, in %s, predicted %s",
+		(long long)report_progress_done, (long long)report_progress_failed, elapsed, predicted);
+
+	/* The status area is replaced for good */
+	report_progress_print(L, line, false);
+
+	return 0;
+}
+
+static int
+lua_report_nothing(lua_State *L) {
+	return 0;
+}
+
+static const luaL_Reg report_progress_funcs[] = {
+	{ "plan",        lua_report_progress_plan },
+	{ "incantation", lua_report_nothing },
+	{ "invocation",  lua_report_progress_invocation },
+	{ "completion",  lua_report_progress_completion },
+	{ "cast",        lua_report_nothing },
+	{ "copy",        lua_report_nothing },
+	{ "remove",      lua_report_nothing },
+	{ "preprocess",  lua_report_nothing },
+	{ "divination",  lua_report_nothing },
+	{ "skip",        lua_report_progress_skip },
+	{ "accounting",  lua_report_nothing },
+	{ "tick",        lua_report_progress_tick },
+	{ "failure",     lua_report_progress_failure },
+	{ "summary",     lua_report_progress_summary },
+	{ NULL, NULL }
+};
+
+int
+luaopen_report_progress(lua_State *L) {
+
+	report_progress_pid = getpid();
+	report_progress_tty = isatty(STDERR_FILENO);
+	report_progress_begin = report_clock();
+
+	luaL_newlibtable(L, report_progress_funcs);
+	lua_newtable(L);
+	lua_newtable(L);
+	luaL_setfuncs(L, report_progress_funcs, 2);
+
+	return 1;
+}
@@ -0,0 +1,408 @@
+#include "hex/lua.h"
+#include "report.h"
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+
+/* Events are written in Chrome's trace event format, as elements of an
+ * unterminated array, which trace viewers accept, so processes can append to it.
+ * Each concurrent invocation is given a lane, shown as a thread of the hex process,
+ * the lane zero being hex itself. Upvalues are the lanes of running invocations,
+ * indexed by material and ritual names, and the set of busy lanes */
+
+#define REPORT_TRACE_LANES lua_upvalueindex(1)
+#define REPORT_TRACE_BUSY  lua_upvalueindex(2)
+
+static int report_trace_fd = -1;
+static pid_t report_trace_pid;
+
+/* Count of lanes named in the trace */
+static lua_Integer report_trace_lanes;
+
+/* Process which reported the last invocation, and its lane. Summoned
+ * processes inherit them, and report their own events on their invocation's lane */
+static pid_t report_trace_summoner = -1;
+static lua_Integer report_trace_lane;
+
+static lua_Integer
+report_trace_current(void) {
+	return report_trace_summoner >= 0 && report_trace_summoner != getpid() ? report_trace_lane : 0;
+}
+
+/* Begins an event of phase ph on lane at timestamp, followed by the name and category fields */
+static void
+report_trace_begin(lua_State *L, luaL_Buffer *b, const char *ph, lua_Integer lane, double timestamp, const char *name, const char *category) {
+	char buffer[128];
+
+	snprintf(buffer, sizeof (buffer), "{\"ph\":\"%s\",\"pid\":%d,\"tid\":%lld,\"ts\":%.0f,\"name\":",
+		ph, (int)report_trace_pid, (long long)lane, timestamp * 1e6);
+
+	luaL_buffinit(L, b);
+	luaL_addstring(b, buffer);
+	report_addjsonstring(b, name, strlen(name));
+	luaL_addstring(b, ",\"cat\":\"");
+	luaL_addstring(b, category);
+	luaL_addchar(b, '"');
+}
+
+/* Adds a string field, prefixed by a comma unless it's the first of an object */
+static void
+report_trace_addfield(luaL_Buffer *b, bool first, const char *key, const char *value, size_t length) {
+	if (!first) {
+		luaL_addchar(b, ',');
+	}
+	luaL_addchar(b, '"');
+	luaL_addstring(b, key);
+	luaL_addstring(b, "\":");
+	report_addjsonstring(b, value, length);
+}
+
+static void
+report_trace_end(lua_State *L, luaL_Buffer *b) {
+	luaL_addstring(b, "},\n");
+	luaL_pushresult(b);
+	report_write(L, report_trace_fd);
+}
+
+/* Emits an instant event of scope (thread, process or global) with string arguments, args being NULL terminated key/value pairs */
+static void
+report_trace_instant(lua_State *L, const char *scope, lua_Integer lane, const char *name, const char *category, const char * const *args) {
+	luaL_Buffer b;
+
+	report_trace_begin(L, &b, "i", lane, report_clock(), name, category);
+	luaL_addstring(&b, ",\"s\":\"");
+	luaL_addstring(&b, scope);
+	luaL_addstring(&b, "\",\"args\":{");
+	for (const char * const *arg = args; *arg != NULL; arg += 2) {
+		report_trace_addfield(&b, arg == args, arg[0], arg[1], strlen(arg[1]));
+	}
+	luaL_addstring(&b, "}");
+	report_trace_end(L, &b);
+}
+
+/* Pushes the key of an invocation of a material's ritual in the lanes table */
+static const char *
+report_trace_pushkey(lua_State *L, const char *name, const char *ritualname) {
+	return lua_pushfstring(L, "%s %s", name, ritualname);
+}
+
+static int
+lua_report_trace_plan(lua_State *L) {
+	char invocations[32], jobs[32], predicted[32];
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "invocations");
+	lua_getfield(L, 1, "jobs");
+	lua_getfield(L, 1, "predicted");
+	snprintf(invocations, sizeof (invocations), "%lld", lua_istable(L, -3) ? (long long)luaL_len(L, -3) : 0LL);
+	snprintf(jobs, sizeof (jobs), "%lld", (long long)lua_tointeger(L, -2));
+	snprintf(predicted, sizeof (predicted), "%.3f", lua_tonumber(L, -1));
+	lua_pop(L, 3);
+
+	const char * const args[] = { "invocations", invocations, "jobs", jobs, "predicted", predicted, NULL };
+	report_trace_instant(L, "g", 0, "plan", "plan", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_incantation(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const args[] = { "material", name, NULL };
+
+	report_trace_instant(L, "p", 0, name, "incantation", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_invocation(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	lua_Integer lane = 1;
+	char buffer[160];
+	luaL_Buffer b;
+
+	/* Lowest free lane */
+	while (lua_rawgeti(L, REPORT_TRACE_BUSY, lane) != LUA_TNIL) {
+		lua_pop(L, 1);
+		lane++;
+	}
+	lua_pop(L, 1);
+
+	lua_pushboolean(L, 1);
+	lua_rawseti(L, REPORT_TRACE_BUSY, lane);
+	const char * const key = report_trace_pushkey(L, name, ritualname);
+	lua_pushvalue(L, -1);
+	lua_pushinteger(L, lane);
+	lua_rawset(L, REPORT_TRACE_LANES);
+
+	report_trace_summoner = getpid();
+	report_trace_lane = lane;
+
+	/* Lanes are named the first time they are used */
+	while (report_trace_lanes < lane) {
+		report_trace_lanes++;
+		snprintf(buffer, sizeof (buffer), "{\"ph\":\"M\",\"pid\":%d,\"tid\":%lld,\"name\":\"thread_name\",\"args\":{\"name\":\"job %lld\"}},\n",
+			(int)report_trace_pid, (long long)report_trace_lanes, (long long)report_trace_lanes);
+		lua_pushstring(L, buffer);
+		report_write(L, report_trace_fd);
+	}
+
+	report_trace_begin(L, &b, "B", lane, report_clock(), key, "invocation");
+	luaL_addstring(&b, ",\"args\":{");
+	report_trace_addfield(&b, true, "material", name, strlen(name));
+	report_trace_addfield(&b, false, "ritual", ritualname, strlen(ritualname));
+	luaL_addstring(&b, "}");
+	report_trace_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_trace_completion(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const char * const message = luaL_optstring(L, 3, NULL);
+	lua_Integer lane = 0;
+	luaL_Buffer b;
+
+	report_trace_pushkey(L, name, ritualname);
+	lua_pushvalue(L, -1);
+	if (lua_rawget(L, REPORT_TRACE_LANES) == LUA_TNUMBER) {
+		lane = lua_tointeger(L, -1);
+		lua_pushnil(L);
+		lua_rawseti(L, REPORT_TRACE_BUSY, lane);
+		lua_pushvalue(L, -2);
+		lua_pushnil(L);
+		lua_rawset(L, REPORT_TRACE_LANES);
+	}
+	lua_pop(L, 1);
+
+	report_trace_begin(L, &b, "E", lane, report_clock(), lua_tostring(L, -1), "invocation");
+	if (message != NULL) {
+		luaL_addstring(&b, ",\"args\":{\"failure\":");
+		report_addjsonstring(&b, message, strlen(message));
+		luaL_addstring(&b, "}");
+	}
+	report_trace_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_trace_cast(lua_State *L) {
+	const char * const program = luaL_checkstring(L, 1);
+	const double elapsed = luaL_checknumber(L, 2);
+	char buffer[64];
+	luaL_Buffer b;
+
+	report_trace_begin(L, &b, "X", report_trace_current(), report_clock() - elapsed, program, "cast");
+	snprintf(buffer, sizeof (buffer), ",\"dur\":%.0f", elapsed * 1e6);
+	luaL_addstring(&b, buffer);
+	report_trace_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_trace_copy(lua_State *L) {
+	char bytes[32];
+
+	snprintf(bytes, sizeof (bytes), "%lld", (long long)luaL_checkinteger(L, 3));
+
+	const char * const args[] = {
+		"source", luaL_checkstring(L, 1),
+		"destination", luaL_checkstring(L, 2),
+		"bytes", bytes,
+		NULL
+	};
+
+	report_trace_instant(L, "t", report_trace_current(), "copy", "filesystem", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_remove(lua_State *L) {
+	const int top = lua_gettop(L);
+	luaL_Buffer b;
+
+	for (int i = 1; i <= top; i++) {
+		luaL_checkstring(L, i);
+	}
+
+	report_trace_begin(L, &b, "i", report_trace_current(), report_clock(), "remove", "filesystem");
+	luaL_addstring(&b, ",\"s\":\"t\",\"args\":{\"paths\":[");
+	for (int i = 1; i <= top; i++) {
+		size_t length;
+		const char * const path = lua_tolstring(L, i, &length);
+
+		if (i != 1) {
+			luaL_addchar(&b, ',');
+		}
+		report_addjsonstring(&b, path, length);
+	}
+	luaL_addstring(&b, "]}");
+	report_trace_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_trace_preprocess(lua_State *L) {
+	const char * const args[] = {
+		"source", luaL_checkstring(L, 1),
+		"destination", luaL_checkstring(L, 2),
+		NULL
+	};
+
+	report_trace_instant(L, "t", report_trace_current(), "preprocess", "filesystem", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_divination(lua_State *L) {
+	const char * const args[] = {
+		"program", luaL_checkstring(L, 1),
+		"memoized", lua_toboolean(L, 2) ? "yes" : "no",
+		NULL
+	};
+
+	report_trace_instant(L, "t", report_trace_current(), "divination", "divination", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_skip(lua_State *L) {
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	const char * const args[] = {
+		"material", name,
+		"ritual", ritualname,
+		"reason", luaL_checkstring(L, 3),
+		NULL
+	};
+
+	report_trace_instant(L, "p", 0, report_trace_pushkey(L, name, ritualname), "skip", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_accounting(lua_State *L) {
+	static const char * const fields[] = {
+		"user", "system", "maxrss", "voluntary", "involuntary", "inblock", "oublock",
+		"cpu", "memorypeak", "readbytes", "writebytes",
+	};
+	const char * const name = luaL_checkstring(L, 1);
+	const char * const ritualname = luaL_checkstring(L, 2);
+	char args[512] = "";
+	size_t length = 0;
+	lua_Integer lane = 0;
+	luaL_Buffer b;
+
+	luaL_checktype(L, 3, LUA_TTABLE);
+
+	/* Numeric fields only, formatted beforehand as the buffer can't share the stack */
+	for (size_t i = 0; i < sizeof (fields) / sizeof (*fields); i++) {
+		if (lua_getfield(L, 3, fields[i]) == LUA_TNUMBER && length < sizeof (args)) {
+			length += snprintf(args + length, sizeof (args) - length, "%s\"%s\":%.17g",
+				length != 0 ? "," : "", fields[i], lua_tonumber(L, -1));
+		}
+		lua_pop(L, 1);
+	}
+
+	report_trace_pushkey(L, name, ritualname);
+	if (lua_rawget(L, REPORT_TRACE_LANES) == LUA_TNUMBER) {
+		lane = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	report_trace_begin(L, &b, "i", lane, report_clock(), "accounting", "accounting");
+	luaL_addstring(&b, ",\"s\":\"t\",\"args\":{");
+	if (length < sizeof (args)) {
+		luaL_addstring(&b, args);
+	}
+	luaL_addstring(&b, "}");
+	report_trace_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_trace_failure(lua_State *L) {
+	const char * const args[] = { "message", luaL_checkstring(L, 1), NULL };
+
+	report_trace_instant(L, "g", 0, "failure", "failure", args);
+
+	return 0;
+}
+
+static int
+lua_report_trace_summary(lua_State *L) {
+	char args[128];
+	luaL_Buffer b;
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_getfield(L, 1, "elapsed");
+	lua_getfield(L, 1, "predicted");
+	snprintf(args, sizeof (args), ",\"s\":\"g\",\"args\":{\"elapsed\":%.3f,\"predicted\":%.3f}",
+		lua_tonumber(L, -2), lua_tonumber(L, -1));
+	lua_pop(L, 2);
+
+	report_trace_begin(L, &b, "i", 0, report_clock(), "summary", "summary");
+	luaL_addstring(&b, args);
+	report_trace_end(L, &b);
+
+	return 0;
+}
+
+static int
+lua_report_nothing(lua_State *L) {
+	return 0;
+}
+
+static const luaL_Reg report_trace_funcs[] = {
+	{ "plan",        lua_report_trace_plan },
+	{ "incantation", lua_report_trace_incantation },
+	{ "invocation",  lua_report_trace_invocation },
+	{ "completion",  lua_report_trace_completion },
+	{ "cast",        lua_report_trace_cast },
+	{ "copy",        lua_report_trace_copy },
+	{ "remove",      lua_report_trace_remove },
+	{ "preprocess",  lua_report_trace_preprocess },
+	{ "divination",  lua_report_trace_divination },
+	{ "skip",        lua_report_trace_skip },
+	{ "accounting",  lua_report_trace_accounting },
+	{ "tick",        lua_report_nothing },
+	{ "failure",     lua_report_trace_failure },
+	{ "summary",     lua_report_trace_summary },
+	{ NULL, NULL }
+};
+
+int
+luaopen_report_trace(lua_State *L) {
+	char header[256];
+
+	report_trace_fd = report_output(L);
+	report_trace_pid = getpid();
+
+	snprintf(header, sizeof (header), "[\n"
+		"{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"hex\"}},\n"
+		"{\"ph\":\"M\",\"pid\":%d,\"tid\":0,\"name\":\"thread_name\",\"args\":{\"name\":\"hex\"}},\n",
+		(int)report_trace_pid, (int)report_trace_pid);
+	lua_pushstring(L, header);
+	report_write(L, report_trace_fd);
+
+	luaL_newlibtable(L, report_trace_funcs);
+	lua_newtable(L);
+	lua_newtable(L);
+	luaL_setfuncs(L, report_trace_funcs, 2);
+
+	return 1;
+}
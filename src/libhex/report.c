@@ -0,0 +1,104 @@
+#include "report.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+
+int
+report_output(lua_State *L) {
+	int fd = STDOUT_FILENO;
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, HEX_REPORT_OUTPUT) == LUA_TNUMBER) {
+		fd = lua_tointeger(L, -1);
+	}
+	lua_pop(L, 1);
+
+	return fd;
+}
+
+const char *
+report_outputpath(lua_State *L) {
+	const char *path = NULL;
+
+	if (lua_getfield(L, LUA_REGISTRYINDEX, HEX_REPORT_OUTPUT_PATH) == LUA_TSTRING) {
+		path = lua_tostring(L, -1);
+	}
+	lua_pop(L, 1);
+
+	return path;
+}
+
+void
+report_write(lua_State *L, int fd) {
+	size_t length;
+	const char *data = lua_tolstring(L, -1, &length);
+
+	/* Reports never fail the performance, a lost event is not worth an error */
+	while (length != 0) {
+		const ssize_t writeval = write(fd, data, length);
+
+		if (writeval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			break;
+		}
+
+		data += writeval;
+		length -= writeval;
+	}
+
+	lua_pop(L, 1);
+}
+
+double
+report_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void
+report_addjsonstring(luaL_Buffer *b, const char *string, size_t length) {
+	const char * const end = string + length;
+
+	luaL_addchar(b, '"');
+
+	while (string != end) {
+		const unsigned char c = *string;
+
+		switch (c) {
+		case '"':
+			luaL_addstring(b, "\\\"");
+			break;
+		case '\\':
+			luaL_addstring(b, "\\\\");
+			break;
+		case '\n':
+			luaL_addstring(b, "\\n");
+			break;
+		case '\r':
+			luaL_addstring(b, "\\r");
+			break;
+		case '\t':
+			luaL_addstring(b, "\\t");
+			break;
+		default:
+			if (c < 0x20) {
+				char escaped[8];
+				snprintf(escaped, sizeof (escaped), "\\u%04x", c);
+				luaL_addstring(b, escaped);
+			} else {
+				luaL_addchar(b, c);
+			}
+			break;
+		}
+
+		string++;
+	}
+
+	luaL_addchar(b, '"');
+}
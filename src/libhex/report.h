@@ -0,0 +1,30 @@
+#ifndef HEX_REPORT_H
+#define HEX_REPORT_H
+
+#include "hex/lua.h"
+
+/* Returns the file descriptor report libraries write their events into,
+ * registered by hex's main under HEX_REPORT_OUTPUT, standard output else */
+int
+report_output(lua_State *L);
+
+/* Returns the path of the report output, registered by hex's main under HEX_REPORT_OUTPUT_PATH,
+ * NULL if the output is the standard output. The string lives as long as the registry holds it */
+const char *
+report_outputpath(lua_State *L);
+
+/* Writes the string on top of the stack into fd with as few writes as possible,
+ * so events reported by concurrent processes don't interleave, and pops it */
+void
+report_write(lua_State *L, int fd);
+
+/* Returns the monotonic clock, in seconds */
+double
+report_clock(void);
+
+/* Adds string as a JSON string literal to the buffer */
+void
+report_addjsonstring(luaL_Buffer *b, const char *string, size_t length);
+
+/* HEX_REPORT_H */
+#endif
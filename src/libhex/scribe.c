@@ -0,0 +1,313 @@
+#include "scribe.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+
+#ifdef __linux__
+#include <sys/prctl.h>
+#endif
+
+#ifdef HEX_ZSTD
+#include <zstd.h>
+
+#define SCRIBE_CONTINUE ZSTD_e_continue
+#define SCRIBE_FLUSH    ZSTD_e_flush
+#define SCRIBE_END      ZSTD_e_end
+#else
+#define SCRIBE_CONTINUE 0
+#define SCRIBE_FLUSH    1
+#define SCRIBE_END      2
+#endif
+
+/* Milliseconds data written in the output may wait before being flushed */
+#define SCRIBE_FLUSH_PERIOD 1000
+
+/* Milliseconds the input is still drained once the scribe was asked to stop */
+#define SCRIBE_DRAIN_PERIOD 1000
+
+struct scribe {
+	int output;
+#ifdef HEX_ZSTD
+	ZSTD_CCtx *cctx;
+	void *compressed;
+	size_t compressedsize;
+#endif
+	/* Ring of the last bytes read, end is where the next byte goes */
+	char *ring;
+	size_t ringsize, ringend;
+	uint64_t total, stored;
+	/* Whether data was written since the last flush, and when the next one is due */
+	bool pending;
+	int64_t flushat;
+};
+
+/* Input and whether the scribe was asked to stop, set by its SIGTERM handler */
+static int scribe_input = -1;
+static volatile sig_atomic_t scribe_stopped;
+
+static void
+scribe_stop(int signo) {
+
+	/* Reads can't block anymore, even if the signal came right before one */
+	fcntl(scribe_input, F_SETFL, fcntl(scribe_input, F_GETFL) | O_NONBLOCK);
+	scribe_stopped = 1;
+}
+
+static inline size_t
+scribe_min(uint64_t a, uint64_t b) {
+	return a < b ? a : b;
+}
+
+static int64_t
+scribe_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (int64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static bool
+scribe_write_fd(int fd, const void *data, size_t size) {
+	const char *current = data;
+
+	while (size != 0) {
+		const ssize_t writeval = write(fd, current, size);
+
+		if (writeval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+
+		current += writeval;
+		size -= writeval;
+	}
+
+	return true;
+}
+
+/* Writes data in the output, flushing or ending the compressed frame according to mode */
+static bool
+scribe_write(struct scribe *scribe, const void *data, size_t size, int mode) {
+
+	scribe->stored += size;
+	scribe->pending = mode == SCRIBE_CONTINUE;
+
+#ifdef HEX_ZSTD
+	ZSTD_inBuffer input = { data, size, 0 };
+	size_t remaining;
+
+	do {
+		ZSTD_outBuffer output = { scribe->compressed, scribe->compressedsize, 0 };
+
+		remaining = ZSTD_compressStream2(scribe->cctx, &output, &input, mode);
+		if (ZSTD_isError(remaining) || !scribe_write_fd(scribe->output, output.dst, output.pos)) {
+			return false;
+		}
+	} while (mode == SCRIBE_CONTINUE ? input.pos != input.size : remaining != 0);
+
+	return true;
+#else
+	return mode != SCRIBE_CONTINUE || scribe_write_fd(scribe->output, data, size);
+#endif
+}
+
+static bool
+scribe_flush(struct scribe *scribe) {
+
+	scribe->flushat = scribe_clock() + SCRIBE_FLUSH_PERIOD;
+
+	return scribe_write(scribe, NULL, 0, SCRIBE_FLUSH);
+}
+
+static void
+scribe_ring_append(struct scribe *scribe, const char *data, size_t size) {
+
+	if (scribe->ringsize == 0) {
+		return;
+	}
+
+	if (size >= scribe->ringsize) {
+		memcpy(scribe->ring, data + size - scribe->ringsize, scribe->ringsize);
+		scribe->ringend = 0;
+		return;
+	}
+
+	const size_t first = scribe_min(size, scribe->ringsize - scribe->ringend);
+
+	memcpy(scribe->ring + scribe->ringend, data, first);
+	memcpy(scribe->ring, data + first, size - first);
+	scribe->ringend = (scribe->ringend + size) % scribe->ringsize;
+}
+
+/* Copies the last count bytes of the ring in a linear buffer */
+static void
+scribe_ring_last(const struct scribe *scribe, char *buffer, size_t count) {
+	const size_t start = (scribe->ringend + scribe->ringsize - count) % scribe->ringsize;
+	const size_t first = scribe_min(count, scribe->ringsize - start);
+
+	memcpy(buffer, scribe->ring + start, first);
+	memcpy(buffer + first, scribe->ring, count - first);
+}
+
+static bool
+scribe_save(const char *filename, const void *data, size_t size) {
+	const int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	bool saved;
+
+	if (fd < 0) {
+		return false;
+	}
+
+	saved = scribe_write_fd(fd, data, size);
+
+	return close(fd) == 0 && saved;
+}
+
+int
+scribe_run(int input, int output, pid_t parent, const char *path, size_t limit, size_t tail) {
+	const size_t pathlen = strlen(path);
+	char filename[pathlen + sizeof (".index") + sizeof (SCRIBE_SUFFIX)];
+	struct scribe scribe = { .output = output, .ringsize = tail };
+	struct sigaction action = { .sa_handler = scribe_stop };
+	bool failed = false;
+	int64_t drainuntil = -1;
+	char block[65536];
+	ssize_t readval;
+
+	/* Without SA_RESTART, so a blocked read is interrupted */
+	scribe_input = input;
+	sigemptyset(&action.sa_mask);
+	sigaction(SIGTERM, &action, NULL);
+
+#ifdef __linux__
+	/* Writers the parent leaves running must not keep the scribe alive */
+	prctl(PR_SET_PDEATHSIG, SIGTERM);
+#endif
+	if (getppid() != parent) {
+		raise(SIGTERM);
+	}
+
+	scribe.ring = tail != 0 ? malloc(tail) : NULL;
+
+	if (tail != 0 && scribe.ring == NULL) {
+		return EXIT_FAILURE;
+	}
+
+#ifdef HEX_ZSTD
+	scribe.cctx = ZSTD_createCCtx();
+	scribe.compressedsize = ZSTD_CStreamOutSize();
+	scribe.compressed = malloc(scribe.compressedsize);
+
+	if (scribe.cctx == NULL || scribe.compressed == NULL) {
+		return EXIT_FAILURE;
+	}
+#endif
+
+	scribe.flushat = scribe_clock() + SCRIBE_FLUSH_PERIOD;
+
+	/* Input is always drained, failing to write must not block nor kill writers.
+	 * Written data is flushed on a timer, so the output can be followed live
+	 * without ending compressed blocks on every read */
+	while (true) {
+
+		if (scribe_stopped && drainuntil < 0) {
+			drainuntil = scribe_clock() + SCRIBE_DRAIN_PERIOD;
+		}
+
+		if (!failed && scribe.pending && !scribe_stopped) {
+			const int64_t timeout = scribe.flushat - scribe_clock();
+			struct pollfd fds = { .fd = input, .events = POLLIN };
+
+			if (poll(&fds, 1, timeout > 0 ? timeout : 0) == 0) {
+				failed = !scribe_flush(&scribe);
+				continue;
+			}
+		}
+
+		readval = read(input, block, sizeof (block));
+		if (readval == 0) {
+			break;
+		}
+
+		if (readval < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			/* Everything written before the scribe was asked to stop was read */
+			failed = failed || (errno != EAGAIN && errno != EWOULDBLOCK);
+			break;
+		}
+
+		/* The head is written as it comes, the rest is only kept in the ring */
+		if (!failed && scribe.total < limit) {
+			failed = !scribe_write(&scribe, block, scribe_min(readval, limit - scribe.total), SCRIBE_CONTINUE);
+		}
+
+		scribe_ring_append(&scribe, block, readval);
+		scribe.total += readval;
+
+		/* Writers which never pause are still flushed once due */
+		if (!failed && scribe.pending && scribe_clock() >= scribe.flushat) {
+			failed = !scribe_flush(&scribe);
+		}
+
+		/* Writers which never pause can't keep a stopped scribe alive either */
+		if (drainuntil >= 0 && scribe_clock() >= drainuntil) {
+			break;
+		}
+	}
+
+	const uint64_t beyond = scribe.total > limit ? scribe.total - limit : 0;
+	const size_t kept = scribe_min(scribe.total, scribe.ringsize);
+	char * const last = malloc(kept + 1);
+
+	if (last == NULL) {
+		return EXIT_FAILURE;
+	}
+
+	if (kept != 0) {
+		scribe_ring_last(&scribe, last, kept);
+	}
+
+	/* The tail follows the head, with a mark if anything in between was elided */
+	if (!failed && beyond != 0) {
+		const size_t appended = scribe_min(beyond, kept);
+		const uint64_t elided = beyond - appended;
+
+		if (elided != 0) {
+			char mark[64];
+			const int marklen = snprintf(mark, sizeof (mark), "\n[%llu bytes elided]\n", (unsigned long long)elided);
+			failed = !scribe_write(&scribe, mark, marklen, SCRIBE_CONTINUE);
+		}
+
+		failed = failed || !scribe_write(&scribe, last + kept - appended, appended, SCRIBE_CONTINUE);
+	}
+
+	failed = failed || !scribe_write(&scribe, NULL, 0, SCRIBE_END);
+
+	memcpy(stpcpy(filename, path), ".tail", sizeof (".tail"));
+	failed = !scribe_save(filename, last, kept) || failed;
+
+	char index[128];
+	const int indexlen = snprintf(index, sizeof (index), "return { size = %llu; stored = %llu; }\n",
+		(unsigned long long)scribe.total, (unsigned long long)scribe.stored);
+	memcpy(stpcpy(filename, path), ".index", sizeof (".index"));
+	failed = !scribe_save(filename, index, indexlen) || failed;
+
+	/* Closed last, releasing the lock which tells waiters everything was written */
+	failed = close(scribe.output) != 0 || failed;
+
+	return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
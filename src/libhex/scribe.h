@@ -0,0 +1,26 @@
+#ifndef HEX_SCRIBE_H
+#define HEX_SCRIBE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Suffix of the file scribes write the captured output in */
+#ifdef HEX_ZSTD
+#define SCRIBE_SUFFIX ".zst"
+#else
+#define SCRIBE_SUFFIX ""
+#endif
+
+/* Copies everything read from input until end of file into output, path followed by SCRIBE_SUFFIX opened
+ * by the caller, compressed if available. Only the first limit bytes and the last tail bytes are kept.
+ * The last tail bytes are also written in path followed by ".tail", and
+ * the total and stored sizes in path followed by ".index", as a Lua table. Output is closed last,
+ * so a lock taken on it by the caller is held until everything was written.
+ * Once SIGTERM is received, sent by the kernel on Linux when parent terminates, input is only
+ * drained of what it holds, for a second at most, so writers left running can't keep it alive.
+ * Meant to be run by a dedicated process, child of parent, returns its exit status. */
+int
+scribe_run(int input, int output, pid_t parent, const char *path, size_t limit, size_t tail);
+
+/* HEX_SCRIBE_H */
+#endif
@@ -0,0 +1,186 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+#include <time.h>
+#include <err.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+/* Compares the latency of fork and execvp, as hex.cast used to spawn processes, to posix_spawnp's,
+ * as the process' heap grows. Forking copies page tables, so its cost grows with the heap,
+ * while posix_spawnp shares the address space with its child until it executes */
+
+#define SPAWNBENCH_SIZES_MAX 16
+
+struct spawnbench_args {
+	unsigned long iterations;
+	unsigned long sizes[SPAWNBENCH_SIZES_MAX];
+	size_t sizescount;
+	char **argv;
+};
+
+static void
+spawnbench_usage(const char *spawnbenchname) {
+	fprintf(stderr, "usage: %s [-n <iterations>] [-m <mebibytes>]... [program [arguments...]]\n", spawnbenchname);
+	exit(EXIT_FAILURE);
+}
+
+static unsigned long
+spawnbench_parse_count(const char *spawnbenchname, const char *string) {
+	char *end;
+	const unsigned long count = strtoul(string, &end, 10);
+
+	if (*string == '\0' || *end != '\0') {
+		fprintf(stderr, "%s: Invalid count '%s'\n", spawnbenchname, string);
+		spawnbench_usage(spawnbenchname);
+	}
+
+	return count;
+}
+
+static const struct spawnbench_args
+spawnbench_parse_args(int argc, char **argv) {
+	static char *defaultargv[] = { "true", NULL };
+	struct spawnbench_args args = {
+		.iterations = 1000,
+		.sizescount = 0,
+		.argv = defaultargv,
+	};
+	int c;
+
+	while (c = getopt(argc, argv, ":n:m:"), c != -1) {
+		switch (c) {
+		case 'n':
+			args.iterations = spawnbench_parse_count(*argv, optarg);
+			break;
+		case 'm':
+			if (args.sizescount == SPAWNBENCH_SIZES_MAX) {
+				fprintf(stderr, "%s: Too many heap sizes\n", *argv);
+				spawnbench_usage(*argv);
+			}
+			args.sizes[args.sizescount++] = spawnbench_parse_count(*argv, optarg);
+			break;
+		case ':':
+			fprintf(stderr, "%s: -%c: Missing argument\n", *argv, optopt);
+			spawnbench_usage(*argv);
+		default:
+			fprintf(stderr, "%s: Unknown argument -%c\n", *argv, optopt);
+			spawnbench_usage(*argv);
+		}
+	}
+
+	if (args.iterations == 0) {
+		fprintf(stderr, "%s: Iterations must be positive\n", *argv);
+		spawnbench_usage(*argv);
+	}
+
+	if (args.sizescount == 0) {
+		static const unsigned long defaultsizes[] = { 0, 64, 256, 512 };
+
+		memcpy(args.sizes, defaultsizes, sizeof (defaultsizes));
+		args.sizescount = sizeof (defaultsizes) / sizeof (*defaultsizes);
+	}
+
+	if (argc != optind) {
+		args.argv = argv + optind;
+	}
+
+	return args;
+}
+
+static double
+spawnbench_clock(void) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void
+spawnbench_wait(pid_t pid) {
+	int wstatus;
+
+	if (waitpid(pid, &wstatus, 0) < 0) {
+		err(EXIT_FAILURE, "waitpid %d", pid);
+	}
+
+	if (!WIFEXITED(wstatus) || WEXITSTATUS(wstatus) != 0) {
+		errx(EXIT_FAILURE, "Benchmarked program failed, status %d", wstatus);
+	}
+}
+
+static void
+spawnbench_fork(char **argv) {
+	const pid_t pid = fork();
+
+	if (pid < 0) {
+		err(EXIT_FAILURE, "fork");
+	}
+
+	if (pid == 0) {
+		execvp(*argv, argv);
+		_exit(255);
+	}
+
+	spawnbench_wait(pid);
+}
+
+static void
+spawnbench_spawn(char **argv) {
+	pid_t pid;
+	const int errcode = posix_spawnp(&pid, *argv, NULL, NULL, argv, environ);
+
+	if (errcode != 0) {
+		errx(EXIT_FAILURE, "posix_spawnp %s: %s", *argv, strerror(errcode));
+	}
+
+	spawnbench_wait(pid);
+}
+
+/* Average microseconds to spawn and reap the program */
+static double
+spawnbench_measure(void (*spawn)(char **), char **argv, unsigned long iterations) {
+	const double start = spawnbench_clock();
+
+	for (unsigned long i = 0; i < iterations; i++) {
+		spawn(argv);
+	}
+
+	return (spawnbench_clock() - start) / iterations * 1e6;
+}
+
+int
+main(int argc, char **argv) {
+	const struct spawnbench_args args = spawnbench_parse_args(argc, argv);
+	unsigned long allocated = 0;
+
+	printf("%10s %16s %16s\n", "heap (MiB)", "fork+exec (us)", "posix_spawn (us)");
+
+	for (size_t i = 0; i < args.sizescount; i++) {
+		const unsigned long size = args.sizes[i];
+
+		/* The heap only grows, pages are touched so they are mapped like a live interpreter's */
+		if (size > allocated) {
+			const size_t length = (size - allocated) << 20;
+			char * const heap = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+			if (heap == MAP_FAILED) {
+				err(EXIT_FAILURE, "mmap %lu MiB", size - allocated);
+			}
+
+			memset(heap, 1, length);
+			allocated = size;
+		}
+
+		const double forked = spawnbench_measure(spawnbench_fork, args.argv, args.iterations);
+		const double spawned = spawnbench_measure(spawnbench_spawn, args.argv, args.iterations);
+
+		printf("%10lu %16.1f %16.1f\n", allocated, forked, spawned);
+	}
+
+	return EXIT_SUCCESS;
+}